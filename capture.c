@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "capture.h"
+
+#define CAPTURE_MAX_RECORD 11 // Longest record: tag and two 5-byte varints
+#define CAPTURE_DUMP_LINE 32 // Log bytes per dumped line
+
+static uint8_t capture_log[CAPTURE_SIZE];
+static uint32_t capture_length = 0; // Bytes used in capture_log
+static bool capture_on = false;
+static bool capture_full = false; // Recording stopped because the log ran out of space
+static int32_t capture_steps = 0; // Net steps since the capture started, reverse ones counting down
+static int32_t capture_edge_steps = 0; // Step count at the previous edge
+static uint32_t capture_input_ms = 0; // Time of the previous command byte (ms since boot)
+
+static void capture_record(uint8_t tag, uint32_t a, uint32_t b, bool with_byte, uint8_t byte); // Append one record
+static uint32_t put_varint(uint8_t *out, uint32_t value); // LEB128-encode a value, returns the bytes written
+static uint32_t zigzag(int32_t value); // Signed to unsigned with small magnitudes staying small: 0, -1, 1, -2, ...
+
+void capture_start() {
+    const uint32_t status = save_and_disable_interrupts();
+    capture_length = 0;
+    capture_full = false;
+    capture_steps = 0;
+    capture_edge_steps = 0;
+    capture_input_ms = to_ms_since_boot(get_absolute_time());
+    capture_on = true;
+    restore_interrupts(status);
+}
+
+void capture_stop() {
+    capture_on = false;
+}
+
+void capture_input(const int c) {
+    if (!capture_on)
+        return;
+    const uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    capture_record(CAPTURE_INPUT, now_ms - capture_input_ms, 0, true, (uint8_t)c);
+    capture_input_ms = now_ms;
+}
+
+void capture_step(const int dir) {
+    if (capture_on)
+        capture_steps += dir;
+}
+
+void capture_edge(const bool level, const uint32_t since_step_us) {
+    if (!capture_on)
+        return;
+    capture_record(level ? CAPTURE_EDGE_HIGH : CAPTURE_EDGE_LOW, zigzag(capture_steps - capture_edge_steps), since_step_us, false, 0);
+    capture_edge_steps = capture_steps;
+}
+
+void capture_status() {
+    printf("Capture: %s, %lu of %d bytes, %ld steps%s\r\n", capture_on ? "on" : "off", (unsigned long)capture_length,
+           CAPTURE_SIZE, (long)capture_steps, capture_full ? ", log full" : "");
+}
+
+void capture_dump() {
+    printf("Capture %lu bytes\r\n", (unsigned long)capture_length);
+    for (uint32_t i = 0; i < capture_length; i += CAPTURE_DUMP_LINE) {
+        printf("C ");
+        for (uint32_t j = i; j < capture_length && j < i + CAPTURE_DUMP_LINE; j++)
+            printf("%02x", capture_log[j]);
+        printf("\r\n");
+    }
+    printf("Capture end\r\n");
+}
+
+static void capture_record(const uint8_t tag, const uint32_t a, const uint32_t b, const bool with_byte, const uint8_t byte) {
+    // The edge interrupt must not interleave with a command byte being appended
+    const uint32_t status = save_and_disable_interrupts();
+    if (capture_length + CAPTURE_MAX_RECORD > CAPTURE_SIZE) {
+        capture_on = false;
+        capture_full = true;
+    } else {
+        uint8_t *out = capture_log + capture_length;
+        *out++ = tag;
+        out += put_varint(out, a);
+        if (with_byte)
+            *out++ = byte;
+        else
+            out += put_varint(out, b);
+        capture_length = (uint32_t)(out - capture_log);
+    }
+    restore_interrupts(status);
+}
+
+static uint32_t zigzag(const int32_t value) {
+    return (uint32_t)value << 1 ^ (uint32_t)(value >> 31);
+}
+
+static uint32_t put_varint(uint8_t *out, uint32_t value) {
+    uint32_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
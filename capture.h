@@ -0,0 +1,22 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CAPTURE_SIZE 8192 // RAM log of command bytes and opto edges (bytes)
+
+// Log record tags; every number in a record is an unsigned LEB128 varint, signed ones zigzag-encoded first
+#define CAPTURE_INPUT 0 // Command byte: ms since the previous one, then the byte
+#define CAPTURE_EDGE_LOW 1 // Filtered falling edge: signed steps since the previous edge, us since the last step
+#define CAPTURE_EDGE_HIGH 2 // Filtered rising edge: same fields
+
+void capture_start(); // Clear the log and start recording
+void capture_stop(); // Stop recording, keep the log
+void capture_input(int c); // Record a command byte as it is read
+void capture_step(int dir); // Count a motor step in the given direction
+void capture_edge(bool level, uint32_t since_step_us); // Record a filtered opto edge (interrupt context)
+void capture_status(); // Print whether recording is on and how full the log is
+void capture_dump(); // Print the log as "C <hex>" lines for the host to save
+
+#endif
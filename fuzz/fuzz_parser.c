@@ -0,0 +1,72 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parse.h"
+#include "gcode.h"
+
+// Commands whose argument handle_command() reads with parse_number_arg()
+static const char *const number_keywords[] = {"filter", "wait", "encoder", "goto", "map"};
+
+// Every parser a complete line can reach, on the line and on each of its suffixes
+static void parse_line(const char *text) {
+    int steps = 0;
+    int duration_ms = 0;
+    int samples = 0;
+    int rate = 0;
+    int value = 0;
+    int offset = 0;
+    int aux = 0;
+    bool level = false;
+    gcode_block block;
+
+    // Commands hand the text after their keyword to the number helpers
+    for (size_t i = 0; i <= strlen(text); i++) {
+        check_if_nums(text + i);
+        get_nums_from_a_string(text + i);
+    }
+    if (validate_run_input(text))
+        get_nums_from_a_string(text + 4);
+    // Calibrated, default and degenerate revolution lengths
+    parse_move_input(text, 4096, &steps, &duration_ms);
+    parse_move_input(text, 4097, &steps, &duration_ms);
+    parse_move_input(text, 1, &steps, &duration_ms);
+    parse_calib_input(text, &samples, &rate);
+    for (size_t i = 0; i < sizeof(number_keywords) / sizeof(number_keywords[0]); i++)
+        parse_number_arg(text, number_keywords[i], &value);
+    // Limits as in main.c: two outputs, gear ratios up to 100
+    parse_out_input(text, 2, &aux, &level);
+    parse_event_input(text, 4096, 2, &offset, &aux, &level);
+    parse_event_input(text, 1, 2, &offset, &aux, &level);
+    parse_follow_input(text, 100, &samples, &rate);
+    if (gcode_is_line(text))
+        gcode_parse(text, &block);
+}
+
+// Bytes as they arrive on the serial port, assembled into lines the way get_input() does
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    input_line line;
+    input_line_reset(&line);
+    for (size_t i = 0; i < size; i++) {
+        if (!input_line_add(&line, data[i]))
+            continue;
+        // Too long and empty lines are rejected before they reach the command handler
+        trim_line(line.text);
+        if (!line.too_long && line.text[0] != '\0')
+            parse_line(line.text);
+        input_line_reset(&line);
+    }
+
+    // The same bytes as stored macro text, split into lines the way exec_macro() does
+    char *text = malloc(size + 1);
+    memcpy(text, data, size);
+    text[size] = '\0';
+    char macro_line[INPUT_LENGTH];
+    for (const char *p = text; *p != '\0';) {
+        p = split_line(p, macro_line);
+        if (macro_line[0] != '\0')
+            parse_line(macro_line);
+    }
+    free(text);
+    return 0;
+}
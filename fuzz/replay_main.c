@@ -0,0 +1,26 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// Stand-in for the libFuzzer driver when the compiler has none: run each file given on the command line once
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        fseek(file, 0, SEEK_END);
+        const long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        uint8_t *data = malloc(size > 0 ? (size_t)size : 1);
+        const size_t read = fread(data, 1, (size_t)size, file);
+        fclose(file);
+        LLVMFuzzerTestOneInput(data, read);
+        free(data);
+    }
+    printf("Ran %d inputs\n", argc - 1);
+    return 0;
+}
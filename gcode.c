@@ -0,0 +1,71 @@
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gcode.h"
+
+bool gcode_is_line(const char *line) {
+    // Console commands are lowercase words; G-code starts with an uppercase word letter or a comment
+    return line[0] != '\0' && strchr("GMNXAF;(", line[0]) != NULL;
+}
+
+bool gcode_parse(const char *line, gcode_block *block) {
+    const char *p = line;
+    memset(block, 0, sizeof(*block));
+
+    while (*p != '\0') {
+        if (isspace((unsigned char)*p)) {
+            p++;
+            continue;
+        }
+        // ';' comment or '*' checksum runs to the end of the line
+        if (*p == ';' || *p == '*')
+            break;
+        // Parenthesised comment
+        if (*p == '(') {
+            p = strchr(p, ')');
+            if (p == NULL)
+                return false;
+            p++;
+            continue;
+        }
+
+        const char letter = (char)toupper((unsigned char)*p++);
+        // Only plain decimal numbers; strtof would also take "inf", "nan" and hex
+        if (*p != '-' && *p != '+' && *p != '.' && !isdigit((unsigned char)*p))
+            return false;
+        char *end;
+        const float value = strtof(p, &end);
+        if (end == p || !isfinite(value))
+            return false;
+        p = end;
+
+        switch (letter) {
+            case 'G':
+            case 'M':
+                // One command per line, whole numbers only (no G28.1 style subcodes)
+                if (block->letter != '\0' || value != floorf(value) || value < 0 || value > 999)
+                    return false;
+                block->letter = letter;
+                block->code = (int)value;
+                break;
+            case 'N':
+                // Line numbers are accepted and ignored
+                break;
+            case 'X':
+            case 'A':
+                block->has_x = true;
+                block->x = value;
+                break;
+            case 'F':
+                if (value <= 0)
+                    return false;
+                block->has_f = true;
+                block->f = value;
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
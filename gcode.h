@@ -0,0 +1,19 @@
+#ifndef GCODE_H
+#define GCODE_H
+
+#include <stdbool.h>
+
+// One parsed G-code line
+typedef struct {
+    char letter; // Command letter 'G' or 'M', '\0' if the line has none (modal move or empty)
+    int code; // Command number, e.g. 1 for G1
+    bool has_x; // Axis word present (X or A)
+    float x; // Axis value in degrees
+    bool has_f; // Feedrate word present
+    float f; // Feedrate in degrees per minute
+} gcode_block;
+
+bool gcode_is_line(const char *line); // Return true if the line looks like G-code rather than a console command
+bool gcode_parse(const char *line, gcode_block *block); // Parse one line into a block, false on syntax error or unsupported word
+
+#endif
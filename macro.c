@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "macro.h"
+
+#define MACRO_MAGIC 0x4d414352 // "MACR": flash sector holds a macro table
+#define MACRO_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE) // Last flash sector, clear of the program
+
+// One stored command sequence
+typedef struct {
+    char name[MACRO_NAME_LENGTH]; // Empty name = free slot
+    char text[MACRO_TEXT_LENGTH]; // Command lines separated by '\n'
+} macro_entry;
+
+// Whole flash sector image: the table padded to the erase size
+typedef union {
+    struct {
+        uint32_t magic;
+        macro_entry entries[MACRO_SLOTS];
+    } table;
+    uint8_t bytes[FLASH_SECTOR_SIZE];
+} macro_sector;
+
+static macro_sector macros; // RAM copy of the flash sector
+
+static bool macro_write(); // Erase the macro sector and program the RAM copy into it
+static macro_entry *macro_entry_for(const char *name); // Slot holding the named macro, NULL if none
+
+void macro_load() {
+    // Flash is memory mapped through XIP, so the table can be read directly
+    const macro_sector *stored = (const macro_sector *)(XIP_BASE + MACRO_FLASH_OFFSET);
+    if (stored->table.magic == MACRO_MAGIC)
+        memcpy(&macros, stored, sizeof(macros));
+    else {
+        // Erased or foreign flash: start with an empty table
+        memset(&macros, 0, sizeof(macros));
+        macros.table.magic = MACRO_MAGIC;
+    }
+}
+
+bool macro_save(const char *name, const char *text) {
+    macro_entry *entry = macro_entry_for(name);
+    // New macro goes into the first free slot
+    if (entry == NULL)
+        entry = macro_entry_for("");
+    if (entry == NULL || strlen(text) >= MACRO_TEXT_LENGTH)
+        return false;
+    strcpy(entry->name, name);
+    strcpy(entry->text, text);
+    return macro_write();
+}
+
+bool macro_delete(const char *name) {
+    macro_entry *entry = macro_entry_for(name);
+    if (entry == NULL || name[0] == '\0')
+        return false;
+    memset(entry, 0, sizeof(*entry));
+    return macro_write();
+}
+
+const char *macro_find(const char *name) {
+    const macro_entry *entry = macro_entry_for(name);
+    if (entry == NULL || name[0] == '\0')
+        return NULL;
+    return entry->text;
+}
+
+void macro_list() {
+    int count = 0;
+    for (int i = 0; i < MACRO_SLOTS; i++) {
+        if (macros.table.entries[i].name[0] != '\0') {
+            printf("%s\r\n", macros.table.entries[i].name);
+            count++;
+        }
+    }
+    printf("%d of %d macros stored\r\n", count, MACRO_SLOTS);
+}
+
+bool macro_valid_name(const char *name) {
+    const int len = (int)strlen(name);
+    if (len == 0 || len >= MACRO_NAME_LENGTH)
+        return false;
+    for (int i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+            return false;
+    }
+    return true;
+}
+
+static bool macro_write() {
+    // Code and interrupt handlers run from flash, so nothing may execute from it while it is rewritten
+    const uint32_t interrupts = save_and_disable_interrupts();
+    flash_range_erase(MACRO_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(MACRO_FLASH_OFFSET, macros.bytes, FLASH_SECTOR_SIZE);
+    restore_interrupts(interrupts);
+    // Read back to confirm the sector took the new table
+    return memcmp((const void *)(XIP_BASE + MACRO_FLASH_OFFSET), macros.bytes, FLASH_SECTOR_SIZE) == 0;
+}
+
+static macro_entry *macro_entry_for(const char *name) {
+    for (int i = 0; i < MACRO_SLOTS; i++) {
+        if (strcmp(macros.table.entries[i].name, name) == 0)
+            return &macros.table.entries[i];
+    }
+    return NULL;
+}
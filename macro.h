@@ -0,0 +1,17 @@
+#ifndef MACRO_H
+#define MACRO_H
+
+#include <stdbool.h>
+
+#define MACRO_SLOTS 8 // Number of macros kept in flash
+#define MACRO_NAME_LENGTH 12 // Maximum macro name length including the terminator
+#define MACRO_TEXT_LENGTH 480 // Maximum command text per macro, lines separated by '\n'
+
+void macro_load(); // Copy the macro table from flash into RAM (empty table if flash holds none)
+bool macro_save(const char *name, const char *text); // Store or replace a macro and write the table to flash
+bool macro_delete(const char *name); // Remove a macro and write the table to flash
+const char *macro_find(const char *name); // Command text of a stored macro, NULL if not defined
+void macro_list(); // Print the names of all stored macros
+bool macro_valid_name(const char *name); // Return true if the name is 1-11 letters, digits or '_'
+
+#endif
@@ -1,116 +1,812 @@
 #include <stdio.h>
 #include "pico/stdlib.h"
 #include "hardware/pwm.h"
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+#include "hardware/irq.h"
+#include "hardware/watchdog.h"
+#include "opto_filter.pio.h"
+#include "step_follower.pio.h"
+#include "quadrature.pio.h"
+#include "macro.h"
+#include "gcode.h"
+#include "stepper.h"
+#include "ramp_table.h"
+#include "parse.h"
+#include "capture.h"
 #include <stdbool.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdlib.h>
+#include <math.h>
 
-#define INPUT_LENGTH 32 // Maximum input line length
+#define INPUT_POLL_US 1000 // Wait for one input character before checking background work
 #define SENSOR 28 // Optical sensor input with pull-up
+#define SENSOR_ADC_INPUT 2 // GP28 is ADC input 2 (ADC_1 connector)
 
-// Stepper motor control pins
-#define IN1 2
-#define IN2 3
-#define IN3 6
-#define IN4 13
-#define INS_SIZE 4
+// Analog opto sensing
+#define ADC_THRESHOLD 2048 // Falling edge is where the opto level crosses this value (12-bit)
+#define ADC_HYSTERESIS 200 // Level must rise this far above the threshold before the next edge is accepted
+#define ADC_CLKDIV 2399 // 48 MHz / (1 + 2399) = 20 kS/s free-running sample rate
+#define ADC_RING_BITS 9 // DMA ring buffer size as a power of two in bytes (512 B = 256 samples)
+#define ADC_RING_SIZE ((1 << ADC_RING_BITS) / 2) // Number of 16-bit samples in the ring buffer
+#define ADC_AVG_SAMPLES 16 // Most recent samples averaged into one level reading
 
-static const uint coil_pins[] = {IN1, IN2, IN3, IN4}; // Stepper motor control pins
+// PIO glitch filter on the opto input
+#define OPTO_FILTER_DEFAULT_US 200 // Default minimum stable time before a level change is accepted
+#define OPTO_FILTER_MAX_US 10000 // Upper limit for the configurable stable time
+#define EDGE_SETTLE_US 100 // Time after a step by which the filter has started timing the edge it caused
+#define EDGE_QUEUE_SIZE 16 // Filtered edges buffered between the PIO interrupt and the main loop (power of two)
+#define STEP_HISTORY_SIZE 16 // Recent steps kept to place filtered edges; covers OPTO_FILTER_MAX_US at MAX_STEP_RATE (power of two)
+
+// Auxiliary outputs (gate, camera trigger) switched by commands
+#define AUX0 14
+#define AUX1 15
+#define AUX_SIZE 2
+
+// STEP/DIR follower input from an external motion controller
+#define STEP_IN 16 // STEP pulse input; DIR must be the next pin for the PIO program
+#define DIR_IN 17 // Direction input: HIGH = forward
+#define FOLLOW_MAX_RATIO 100 // Largest numerator or denominator of the gear ratio
+
+// Optional quadrature encoder on the output shaft
+#define ENC_A 18 // Encoder channel A; B must be the next pin for the PIO program
+#define ENC_B 19 // Encoder channel B
+#define ENCODER_ERROR_MARGIN 8.0f // Following error (steps) beyond one encoder count that counts as missed steps
+#define ENCODER_MAX_COUNTS 100000 // Largest accepted counts per revolution
+
+// Macros and on-device sequencing
+#define MACRO_MAX_DEPTH 4 // Nested "exec" levels allowed
+#define WAIT_MAX_MS 60000 // Longest single "wait"
+#define HOME_SEARCH_MAX 8192 // Safety limit for the home edge search (steps)
+
+// Calibration statistics
+#define SAFE_STEPS_PER_REV 4096 // Per-revolution allowance for the calibration safety limit
+#define CALIB_MAX_STDDEV 2.0f // Largest accepted standard deviation of the kept samples (steps)
+#define CALIB_RETRIES 2 // Extra calibration attempts when the spread is too high
+#define OUTLIER_MAD_SCALE 3.0f // Samples further than this many robust deviations from the median are rejected
+#define OUTLIER_MIN_STEPS 4.0f // Never reject samples closer than this to the median
+
+// Backlash measurement
+#define BACKLASH_CYCLES 3 // Forward/reverse approaches to the sensor edge averaged into one result
+#define BACKLASH_OVERTRAVEL 32 // Steps driven past the forward edge before reversing
+#define BACKLASH_SEARCH_MAX 8192 // Safety limit for each edge search (steps)
+
+// Slot position map
+#define RUN_MAX_SLOTS (SLOTS * 1000) // Longest "run N"; keeps slot arithmetic far from int overflow
+
+// G-code streaming
+#define PLANNER_SIZE 8 // G-code moves buffered for lookahead
+#define GCODE_IDLE_MS 50 // Input silence after which buffered moves are run
+#define GCODE_DEFAULT_FEED 3600.0f // Feedrate before the first F word (degrees/min)
+
+// Resonance scan: step rates are split into bins that can be flagged as resonant
+#define RES_SCAN_MIN 200.0f // Lowest scanned step rate (steps/s)
+#define RES_SCAN_STEP 50.0f // Width of one rate bin (steps/s)
+#define RES_BINS 12 // Bins from RES_SCAN_MIN up to MAX_STEP_RATE
+#define RES_MISSED_STEPS 3 // Revolution length error that counts as missed steps
+#define RES_SCAN_REVS 3 // Revolutions cruised per bin: the falling edge lag is compared across them
+#define RES_JITTER_PERIODS 0.5f // Spread of the falling edge lag over the revolutions, in step periods, that counts as jitter
+#define SAFE_STEP_RATE 333.0f // Constant rate of run, goto, home and stall retries (steps/s) unless it is resonant
+
+// Stall detection
+#define STALL_WINDOW 32 // Sensor edges may be this many steps off their expected position
+#define STALL_SETTLE_MS 50 // Pause before the slow retry after a missing edge
+#define STALL_RETRY_STEPS 128 // Steps crept forward at the safe rate looking for the missing edge
+
+// Watchdog recovery
+#define WATCHDOG_TIMEOUT_MS 2000 // Reset if neither the motion engine nor the input loop runs for this long
+#define WAIT_SLICE_MS 100 // "wait" sleeps in slices so the watchdog keeps being fed
+#define RECOVERY_MAGIC 0x53544550 // "STEP" in scratch[0]: scratch[1..3] hold recovery state
+
+// Move profile cache
+#define PROFILE_CACHE_SIZE 8 // Computed profiles kept for repeated moves
+
+// Position-triggered outputs
+#define EVENT_SLOTS 8 // Output events that can be armed at once
+
+// Trapezoidal velocity profile for a move of a given number of half-steps
+typedef struct {
+    int steps; // Total half-steps in the move
+    int dir; // Direction: 1 = forward, -1 = reverse
+    float accel; // Acceleration and deceleration rate (steps/s^2)
+    float entry_rate; // Step rate at the start of the move (steps/s), 0 from standstill
+    float cruise_rate; // Step rate on the flat part of the trapezoid (steps/s)
+    float exit_rate; // Step rate at the end of the move (steps/s), 0 to standstill
+    float accel_steps; // Steps spent accelerating from the entry rate
+    float accel_time; // Seconds spent accelerating from the entry rate
+    float decel_steps; // Steps spent decelerating to the exit rate
+    float total_time; // Total duration of the move (s)
+    const ramp_table *ramp; // Precomputed ramp for the acceleration, NULL to compute step times
+} move_profile;
+
+// Auxiliary output switched when the output shaft reaches a position
+typedef struct {
+    int offset; // Half-steps from slot 0 within the revolution
+    int aux; // Auxiliary output index
+    bool level; // Level written to the output
+} output_event;
+
+// What a cached move profile was computed from
+typedef enum {
+    PROFILE_TIMED, // solve_timed_profile(): speed holds the duration in ms
+    PROFILE_SEGMENT // segment_profile(): speed holds the requested cruise rate
+} profile_mode;
+
+typedef struct {
+    profile_mode mode; // Which solver produced the profile
+    int steps; // Distance (half-steps)
+    float speed; // Duration (ms) or cruise rate (steps/s), depending on mode
+    float entry; // Entry rate (steps/s)
+    float exit; // Exit rate (steps/s)
+    float accel; // Acceleration limit (steps/s^2)
+} profile_key;
+
+// One slot of the least-recently-used move profile cache
+typedef struct {
+    bool used; // Slot holds a profile
+    uint32_t last_used; // Cache clock at the last hit or store, oldest is replaced first
+    profile_key key; // Inputs the profile was computed from
+    move_profile profile; // Computed profile
+} profile_cache_entry;
+
+// G-code move waiting in the planner buffer
+typedef struct {
+    int steps; // Half-steps to move, without backlash take-up
+    int dir; // Direction: 1 = forward, -1 = reverse
+    float rate; // Requested cruise rate (steps/s)
+} planned_move;
+
+// Streaming mean and variance accumulator (Welford's algorithm)
+typedef struct {
+    int n; // Number of samples added
+    float mean; // Running mean
+    float m2; // Running sum of squared differences from the mean
+} welford;
+
+// Result of a statistical calibration
+typedef struct {
+    int samples; // Revolutions measured
+    int rejected; // Samples rejected as outliers
+    float median; // Median of all samples
+    float mean; // Mean of the kept samples
+    float stddev; // Sample standard deviation of the kept samples
+    float ci95; // Half-width of the 95 % confidence interval of the mean
+} calib_stats;
+
+// Calibration kept in RAM that is not cleared at boot; the checksum in a watchdog scratch register says if it survived
+typedef struct {
+    float calibrated_rev; // Fractional steps per revolution
+    int steps_per_rev; // Whole steps per revolution used for moves
+    calib_stats stats; // Statistics shown by "status"
+    int reference_position; // Motor position of slot 0
+    int rise_offset; // Falling to rising sensor edge distance
+    int backlash_steps; // Measured gear backlash
+    int16_t slot_correction[SLOTS]; // Taught slot map
+    uint32_t resonance_bins; // Flagged resonance bands
+    int gcode_origin; // Motor position of G-code X0
+} saved_calibration;
+
+// Filtered opto edge delivered by the PIO interrupt
+typedef struct {
+    uint64_t time_us; // Time the input first showed the new level (filter delay removed)
+    int position; // Motor step position at that time
+    bool level; // New input level: false = falling edge (obstacle), true = rising edge
+} opto_edge;
+
+// Half-step as remembered for placing filtered edges
+typedef struct {
+    uint32_t time_us; // Time the step was taken (low 32 bits)
+    int before; // Motor position before the step
+} step_record;
+
+// Outcome of checking sensor edges against their expected positions during a move
+typedef enum {
+    WATCH_OK, // Edges where expected (or none due yet)
+    WATCH_RECOVERED, // Edge late but found by the slow retry: steps were missed, position corrected
+    WATCH_STALLED // Edge not found: rotor is not following, position is lost
+} watch_result;
+
+// Expected-edge window tracking for stall detection
+typedef struct {
+    bool enabled; // Watching this move (forward, calibrated, detection on)
+    float expected; // Motor position where the next sensor edge should appear
+    bool level; // Sensor level that edge switches to: false = falling, true = rising
+    bool prev_state; // Previous raw sensor reading when the filter is off
+    int dir; // Direction of the move: 1 = forward, -1 = reverse
+} edge_watch;
+
+static const uint aux_pins[] = {AUX0, AUX1}; // Auxiliary output pins
+// Free-running ADC samples written by DMA, aligned so the DMA write address can wrap around it
+static uint16_t adc_ring[ADC_RING_SIZE] __attribute__((aligned(1 << ADC_RING_BITS)));
+static int adc_dma_chan = -1; // DMA channel feeding adc_ring, -1 when not sampling
+
+static volatile int position = 0; // Absolute motor position in half-steps
+static int last_direction = 1; // Direction of the most recent half-step: 1 = forward, -1 = reverse
+static int backlash_steps = 0; // Measured gear backlash taken up on every direction change
+static int takeup_left = 0; // Steps in last_direction still to go before the output shaft follows the motor
+static int reference_position = 0; // Motor position of the last calibration falling edge (slot 0)
+static int16_t slot_correction[SLOTS] = {0}; // Taught deviation of each slot from its nominal k/8 position (steps)
+static uint32_t resonance_bins = 0; // Bit i set: cruising at rates in bin i misses steps or jitters
+static float calibrated_rev = 0; // Calibrated steps per revolution (fractional), 0 = not calibrated
+static int steps_per_rev = 4096; // Whole steps per revolution used for moves (default before calibration)
+static calib_stats stats = {0}; // Statistics of the last successful calibration
+static bool analog_sensing = false; // Locate opto edges from ADC samples instead of digital reads
+static bool recording = false; // Lines go into macro_text instead of being executed
+static char macro_name[MACRO_NAME_LENGTH]; // Name of the macro being recorded
+static char macro_text[MACRO_TEXT_LENGTH]; // Lines recorded so far
+static int macro_depth = 0; // Nesting level of running macros
+static output_event events[EVENT_SLOTS]; // Armed position-triggered outputs
+static int event_count = 0; // Entries used in events[]
+static int event_offset = -1; // Revolution offset the events were last checked at
+static profile_cache_entry profile_cache[PROFILE_CACHE_SIZE]; // Recently computed move profiles
+static uint32_t cache_clock = 0; // Increments on every cache access, orders entries by last use
+static uint32_t cache_hits = 0; // Profiles served from the cache
+static uint32_t cache_misses = 0; // Profiles that had to be computed
+static saved_calibration __uninitialized_ram(recovery); // Survives a watchdog reset, see save_recovery()
+static int phase = 0; // Half-step phase (0-7) currently on the coils
+static bool gcode_mode = false; // Last line was G-code: no prompt, answer "ok"
+static bool gcode_relative = false; // G91 relative (true) or G90 absolute (false) positioning
+static int gcode_motion = 0; // Modal motion command (G0 or G1) for lines with only an axis word
+static float gcode_feed = GCODE_DEFAULT_FEED; // Modal feedrate (degrees/min)
+static int gcode_origin = 0; // Motor position of G-code X0
+static float gcode_target = 0; // Motor position (fractional) at the end of the buffered moves
+static planned_move planner[PLANNER_SIZE]; // Buffered G-code moves, oldest first
+static int planner_count = 0; // Moves in the planner buffer
+static float planner_entry = 0; // Step rate the next buffered move starts at
+static int rise_offset = 0; // Steps from the falling to the rising sensor edge, 0 = unknown
+static bool position_valid = false; // Output position is known relative to the reference edge
+static bool stall_detection = true; // Check sensor edges during moves
+static volatile uint32_t last_step_us = 0; // Time of the most recent half-step (low 32 bits)
+
+static const PIO filter_pio = pio0; // PIO block running the opto glitch filter and the STEP/DIR follower
+static int filter_sm = -1; // State machine running the filter, -1 before first start
+static uint filter_offset = 0; // Program offset of the filter in PIO instruction memory
+static uint filter_us = 0; // Active minimum stable time, 0 = filter disabled
+static volatile opto_edge edge_queue[EDGE_QUEUE_SIZE]; // Filtered edges waiting to be consumed
+static volatile uint edge_head = 0; // Next slot written by the interrupt
+static volatile uint edge_tail = 0; // Next slot read by the main loop
+static volatile step_record step_history[STEP_HISTORY_SIZE]; // Most recent steps, for the interrupt to look back through
+static volatile uint step_head = 0; // Steps recorded so far; the newest is at step_head - 1
+static int follower_sm = -1; // State machine counting STEP/DIR pulses, -1 before first start
+static volatile int follower_pulses = 0; // Net STEP pulses counted since the follower started
+static const PIO encoder_pio = pio1; // PIO block decoding the quadrature encoder
+static int encoder_sm = -1; // State machine sampling the encoder, -1 before first start
+static int encoder_counts = 0; // Encoder counts per output revolution (4x decoded), 0 = encoder off
+static volatile int encoder_count = 0; // Decoded encoder position
+static volatile int encoder_state = -1; // Last A/B state seen by the interrupt, -1 before the first
+static int encoder_origin = 0; // Output position at which encoder_count was 0
 
 void ini_coil_pins(); // Initialize motor coil output pins as outputs
 void ini_sensor(); // Initialize optical sensor input with internal pull-up
-int calibrate(int max, int revolution_steps[3]); // Measure steps per revolution using the optical sensor
-void step_motor(); // Perform one half-step of the stepper motor
-int get_avg(const int revolution_steps[3]); // Calculate the average of three revolution step counts
+void ini_aux_outputs(); // Initialize auxiliary output pins as outputs, LOW
+void start_adc_sampling(); // Start free-running ADC conversions of the opto level into the DMA ring buffer
+void stop_adc_sampling(); // Stop ADC conversions and return the opto pin to digital input
+int read_adc_level(); // Average of the most recent ADC samples of the opto level
+int position_at(uint32_t time_us); // Motor position at a recent time, from the step history
+void ini_opto_filter(uint stable_us); // (Re)start the PIO glitch filter on the opto input, 0 disables it
+void opto_filter_irq(); // Timestamp filtered edges from the PIO RX FIFO into the edge queue
+bool pop_opto_edge(opto_edge *edge); // Take the oldest filtered edge from the queue, false if none
+void follower_irq(); // Count STEP/DIR pulses from the PIO RX FIFO
+void ini_encoder(int counts); // Start decoding the quadrature encoder with the given counts per revolution, 0 stops it
+void encoder_irq(); // Count encoder steps from the A/B states in the PIO RX FIFO
+float following_error(int dir); // Steps the output shaft trails the step count in the given direction
+watch_result encoder_check(int dir, int *missed); // Correct the step count when the encoder shows missed steps
+void follow(int numerator, int denominator); // Drive the motor from the STEP/DIR inputs until Enter is pressed
+int calibrate(int max, float revolution_steps[], int samples, bool analog, uint32_t step_us); // Measure steps of consecutive revolutions, returns how many were measured
+void step_motor(int dir); // Perform one half-step of the stepper motor forward (1) or in reverse (-1)
+void energize_coils(bool on); // Drive the current phase onto the coils, or switch all coils off
+void fire_events(); // Switch the outputs of events at the position just stepped to
+void list_events(); // Print the armed output events
+int backlash_takeup(int dir); // Extra steps needed before a move in the given direction moves the output
+bool step_until_level(int dir, bool level); // Step until the opto input reads the given level, false on safety limit
+int measure_backlash(); // Approach the sensor edge from both directions and return the backlash in steps, -1 on failure
+void welford_add(welford *w, float x); // Add one sample to a streaming mean/variance accumulator
+float welford_stddev(const welford *w); // Sample standard deviation of the accumulated samples
+void calib_statistics(const float revolution_steps[], int n, calib_stats *stats); // Median, outlier rejection, mean, spread and confidence interval
 void run_motor(int count, int steps_per_rev); // Run the motor for N * (1/8) revolutions using the calibrated steps per revolution
+void run_steps(int steps); // Step forward at the constant safe rate, taking up backlash first
+int output_position(); // Motor position with the backlash lag of the output shaft removed
+int offset_from_reference(int steps_per_rev); // Output position within the revolution, counted from slot 0
+int slot_offset(int slot, int steps_per_rev); // Mapped step offset of a slot from slot 0, any slot number
+int nearest_slot(int steps_per_rev); // Slot (0-8) the output is currently closest to
+void watch_begin(edge_watch *w, int dir); // Start watching sensor edges for a move in the given direction
+void watch_expect_next(edge_watch *w, float from); // Set the first sensor edge expected beyond the given motor position
+bool watch_edge(edge_watch *w, bool *level, int *edge_position); // Next sensor edge seen, from the filter queue or raw reads
+watch_result watch_step(edge_watch *w, int *missed); // Check edges after a step; retry slowly when an edge is overdue
+bool solve_timed_profile(int steps, int duration_ms, move_profile *profile); // Solve a trapezoid that covers the steps in exactly the given time
+uint64_t profile_step_us(const move_profile *profile, int step); // Time (us) from move start at which the given step is taken
+uint64_t run_profile(const move_profile *profile); // Step the motor following a solved trapezoidal profile, returns start time (us)
+void cruise_profile(int steps, float rate, move_profile *profile); // Fastest profile with the given cruise rate at full acceleration
+void segment_profile(int steps, float entry, float rate, float exit, move_profile *profile); // Trapezoid between given entry and exit rates
+void fill_segment_profile(int steps, float entry, float rate, float exit, move_profile *profile); // Compute a segment profile without the cache
+bool profile_cache_get(const profile_key *key, move_profile *profile); // Copy a cached profile, false if it is not cached
+void profile_cache_put(const profile_key *key, const move_profile *profile); // Store a profile, replacing the least recently used one
+void profile_cache_clear(); // Forget all cached profiles
+void handle_gcode(const char *line); // Execute one G-code line and answer "ok" or "error"
+bool plan_gcode_move(float target, float rate); // Buffer a move to the target motor position, running the oldest if full
+void run_planned(int count); // Run the oldest buffered moves with lookahead over the whole buffer
+void input_idle(int idle_ms); // Background work while waiting for input
+int resonance_bin(float rate); // Rate bin a step rate falls in, -1 outside the scanned range
+float resonance_free_rate(float rate); // The rate itself, or the nearest one outside its flagged resonance band
+uint32_t safe_step_us(); // Step period of the constant-rate moves, clear of flagged resonance bands
+bool scan_resonance(int steps_per_rev); // Cruise a few revolutions per rate bin and flag bins with missed steps or jitter
+void handle_command(const char *user_input); // Parse and execute one command line
+void record_macro_line(const char *user_input); // Append a line to the macro being recorded, "end" stores it
+void exec_macro(const char *name); // Run the stored command lines of a macro
+bool home(); // Creep forward to the opto falling edge and make it the slot 0 reference
 char *handle_input(); // Read a single non-empty command from user input
 bool get_input(char *user_input); // Read a line from stdin, validate it, and remove newline characters
-void trim_line(char *user_input); // Remove '\n' and '\r' characters from the end of a string
-bool check_if_nums(const char *string); // Return true if the string contains only digits (0–9)
-int get_nums_from_a_string(const char *string); // Extract digits from a string, form an integer (rejects leading zeros)
-bool validate_run_input(const char *user_input); // Validate that "run" command has a proper numeric argument ("run N")
 void invalid_input(); // Print invalid input message
+void save_recovery(); // Copy the calibration to reset-proof RAM and its checksum, position and phase to the watchdog scratch registers
+void save_step_state(); // Write position, phase and direction to the watchdog scratch registers
+bool restore_recovery(); // After a watchdog reset, restore position and calibration if the checksum matches
+uint32_t recovery_checksum(const saved_calibration *saved); // FNV-1a hash of the saved calibration
 
 int main() {
-    // Safety limit to prevent infinite rotation during calibration
-    const int safe_max = 20480; // Safety limit: 5 * 4096 steps
-    int steps_per_rev = 4096; // Default steps per revolution before calibration
-    int avg = 0;
-    int revolution_steps[3] = {0, 0, 0}; // Array to store step counts between four consecutive edges
-
     // Initialize chosen serial port
     stdio_init_all();
     // Initialize stepper motor pins
     ini_coil_pins();
     // Initialize optical sensor input (with internal pull-up)
     ini_sensor();
+    // Filter coil noise out of the opto input before calibration sees it
+    ini_opto_filter(OPTO_FILTER_DEFAULT_US);
+    ini_aux_outputs();
+    // Stored command sequences
+    macro_load();
+    // Pick up where the firmware was if the watchdog reset it, then keep it watched
+    if (restore_recovery())
+        printf(position_valid ? "Watchdog reset: position and calibration restored\r\n"
+                              : "Watchdog reset: calibration restored, position lost (home or calibrate)\r\n");
+    watchdog_enable(WATCHDOG_TIMEOUT_MS, true);
 
     while (true) {
-        // Read one user command (status / calib / run [N])
+        // Read one user command and execute it, or record it while defining a macro
         const char *user_input = handle_input();
+        if (recording)
+            record_macro_line(user_input);
+        else
+            handle_command(user_input);
+        save_recovery();
+    }
+}
 
-        // status command: print system state
-        if (strcmp(user_input, "status") == 0) {
-            if (avg > 0) {
-                // Calibration completed, display calibration information
-                printf("Calibrated: yes\r\n");
-                printf("Steps per revolution: %d\r\n", steps_per_rev);
-                //printf("Current step: %d\r\n", current_phase);
-            }
-            else {
-                // Not yet calibrated
-                printf("Calibrated: no\r\n");
-                printf("Not available\r\n");
-            }
+void save_recovery() {
+    memset(&recovery, 0, sizeof(recovery));
+    recovery.calibrated_rev = calibrated_rev;
+    recovery.steps_per_rev = steps_per_rev;
+    recovery.stats = stats;
+    recovery.reference_position = reference_position;
+    recovery.rise_offset = rise_offset;
+    recovery.backlash_steps = backlash_steps;
+    memcpy(recovery.slot_correction, slot_correction, sizeof(slot_correction));
+    recovery.resonance_bins = resonance_bins;
+    recovery.gcode_origin = gcode_origin;
+    watchdog_hw->scratch[0] = RECOVERY_MAGIC;
+    watchdog_hw->scratch[3] = recovery_checksum(&recovery);
+    save_step_state();
+}
+
+void save_step_state() {
+    // Bits 0-7: phase, bit 8: last step was reverse, bit 9: position valid, bits 10-31: backlash take-up left
+    watchdog_hw->scratch[1] = (uint32_t)position;
+    watchdog_hw->scratch[2] = (uint32_t)phase | (last_direction < 0) << 8 | position_valid << 9 | (uint32_t)takeup_left << 10;
+}
+
+bool restore_recovery() {
+    // A power-up or reset button leaves the uninitialized RAM and scratch registers meaningless
+    if (!watchdog_caused_reboot() || watchdog_hw->scratch[0] != RECOVERY_MAGIC ||
+        watchdog_hw->scratch[3] != recovery_checksum(&recovery))
+        return false;
+    const uint32_t state = watchdog_hw->scratch[2];
+    if (recovery.calibrated_rev <= 0)
+        return false;
+
+    calibrated_rev = recovery.calibrated_rev;
+    steps_per_rev = recovery.steps_per_rev;
+    stats = recovery.stats;
+    reference_position = recovery.reference_position;
+    rise_offset = recovery.rise_offset;
+    backlash_steps = recovery.backlash_steps;
+    memcpy(slot_correction, recovery.slot_correction, sizeof(slot_correction));
+    resonance_bins = recovery.resonance_bins;
+    gcode_origin = recovery.gcode_origin;
+    position = (int)watchdog_hw->scratch[1];
+    last_direction = state & 1u << 8 ? -1 : 1;
+    takeup_left = (int)(state >> 10);
+    // The calibration does not depend on the position; after a stall only the position has to be found again
+    position_valid = (state & 1u << 9) != 0;
+    // The rotor is still held at this phase: energize it again so it does not jump
+    phase = (int)(state & 0xff);
+    energize_coils(true);
+    return true;
+}
+
+uint32_t recovery_checksum(const saved_calibration *saved) {
+    const uint8_t *bytes = (const uint8_t *)saved;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(*saved); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+void handle_command(const char *user_input) {
+    int number = 0; // Argument of "KEYWORD N" commands
+    // G-code lines share the input path with the console commands
+    if (gcode_is_line(user_input)) {
+        handle_gcode(user_input);
+        return;
+    }
+    // Any console command leaves G-code streaming: moves still buffered run first
+    gcode_mode = false;
+    run_planned(planner_count);
+
+    // status command: print system state
+    if (strcmp(user_input, "status") == 0) {
+        if (calibrated_rev > 0) {
+            // Calibration completed, display calibration information
+            printf("Calibrated: yes\r\n");
+            printf("Position: %s\r\n", position_valid ? "valid" : "lost (stall)");
+            printf("Steps per revolution: %d\r\n", steps_per_rev);
+            printf("Measured steps per revolution: %.2f +/- %.2f (95 %%, n=%d, rejected %d)\r\n",
+                   calibrated_rev, stats.ci95, stats.samples - stats.rejected, stats.rejected);
+            //printf("Current step: %d\r\n", current_phase);
         }
-        // calib command: perform calibration
-        else if (strcmp(user_input, "calib") == 0) {
-            // Run calibration and compute average from 3 rotations
-            avg = calibrate(safe_max, revolution_steps);
-            if (avg > 0) {
-                // Update step count per revolution
-                steps_per_rev = avg;
-                printf("Calibration completed\r\n");
-            }
-            else {
-                // Calibration failed (too few edges detected)
-                printf("Calibration failed\r\n");
+        else {
+            // Not yet calibrated
+            printf("Calibrated: no\r\n");
+            printf("Not available\r\n");
+        }
+        printf("Backlash: %d steps\r\n", backlash_steps);
+        printf("Stall detection: %s\r\n", stall_detection ? "on" : "off");
+        printf("Sensor: %s\r\n", analog_sensing ? "analog" : "digital");
+        printf("Opto filter: %u us\r\n", filter_us);
+        if (encoder_counts > 0)
+            printf("Encoder: %d counts/rev, count %d, following error %.1f steps\r\n",
+                   encoder_counts, encoder_count, calibrated_rev > 0 ? following_error(1) : 0.0f);
+        else
+            printf("Encoder: off\r\n");
+        printf("Resonant rates:");
+        for (int bin = 0; bin < RES_BINS; bin++) {
+            if (resonance_bins & 1u << bin)
+                printf(" %d-%d", (int)(RES_SCAN_MIN + bin * RES_SCAN_STEP), (int)(RES_SCAN_MIN + (bin + 1) * RES_SCAN_STEP));
+        }
+        printf(resonance_bins ? " steps/s\r\n" : " none\r\n");
+    }
+    // filter command: "filter N" sets the opto minimum stable time in microseconds, 0 disables it
+    else if (parse_number_arg(user_input, "filter", &number)) {
+        if (number <= OPTO_FILTER_MAX_US)
+            ini_opto_filter(number);
+        else
+            printf("Filter time must be at most %d us\r\n", OPTO_FILTER_MAX_US);
+    }
+    // backlash command: measure gear backlash at the sensor edge
+    else if (strcmp(user_input, "backlash") == 0) {
+        const int measured = measure_backlash();
+        if (measured >= 0) {
+            backlash_steps = measured;
+            // The measurement ends well past the edge in reverse: the play is taken up
+            takeup_left = 0;
+            printf("Backlash: %d steps\r\n", backlash_steps);
+        }
+        else
+            printf("Backlash measurement failed\r\n");
+    }
+    // stall command: enable or disable the expected-edge stall check
+    else if (strcmp(user_input, "stall on") == 0)
+        stall_detection = true;
+    else if (strcmp(user_input, "stall off") == 0)
+        stall_detection = false;
+    // def command: "def NAME" records the following lines as a macro until "end"
+    else if (strncmp(user_input, "def ", 4) == 0) {
+        // Macros cannot define macros
+        if (macro_depth > 0 || !macro_valid_name(user_input + 4))
+            invalid_input();
+        else {
+            strcpy(macro_name, user_input + 4);
+            macro_text[0] = '\0';
+            recording = true;
+            printf("Recording %s, finish with end\r\n", macro_name);
+        }
+    }
+    // exec command: "exec NAME" runs a stored macro
+    else if (strncmp(user_input, "exec ", 5) == 0)
+        exec_macro(user_input + 5);
+    else if (strcmp(user_input, "macros") == 0)
+        macro_list();
+    else if (strncmp(user_input, "undef ", 6) == 0) {
+        if (!macro_delete(user_input + 6))
+            printf("No macro %s\r\n", user_input + 6);
+    }
+    // wait command: "wait MS" pauses, mainly between macro steps
+    else if (parse_number_arg(user_input, "wait", &number)) {
+        if (number > 0 && number <= WAIT_MAX_MS) {
+            for (int left = number; left > 0; left -= WAIT_SLICE_MS) {
+                watchdog_update();
+                sleep_ms(left < WAIT_SLICE_MS ? left : WAIT_SLICE_MS);
             }
         }
-        // run command: "run" or "run N"
-        else if (strncmp(user_input, "run", 3) == 0) {
-            // Calibration required before running
-            if (avg > 0) {
-                // If command is in form "run N"
-                if (validate_run_input(user_input)) {
-                    // Extract numeric argument from "run N"
-                    const int num_out = get_nums_from_a_string(user_input + 4);
-                    // Run only if N > 0
-                    if (num_out > 0)
-                        run_motor(num_out, steps_per_rev);
-                    else
-                        invalid_input(); // Nonpositive or invalid number
-                }
-                // If command is plain "run" to rotate one full revolution (8 * 1/8)
-                else if (strlen(user_input) == 3)
-                    run_motor(8, steps_per_rev);
+        else
+            invalid_input();
+    }
+    // out command: "out K 0|1" switches auxiliary output K
+    else if (strncmp(user_input, "out ", 4) == 0) {
+        int k = 0;
+        bool level = false;
+        if (parse_out_input(user_input, AUX_SIZE, &k, &level))
+            gpio_put(aux_pins[k], level);
+        else
+            invalid_input();
+    }
+    // at command: "at P K 0|1" switches output K when the output shaft reaches P half-steps past slot 0
+    else if (strncmp(user_input, "at ", 3) == 0) {
+        output_event event;
+        if (calibrated_rev <= 0)
+            printf("Calibrate first\r\n");
+        else if (!parse_event_input(user_input, steps_per_rev, AUX_SIZE, &event.offset, &event.aux, &event.level))
+            invalid_input();
+        else if (event_count == EVENT_SLOTS)
+            printf("All %d output events in use\r\n", EVENT_SLOTS);
+        else {
+            events[event_count++] = event;
+            event_offset = -1;
+        }
+    }
+    else if (strcmp(user_input, "events") == 0)
+        list_events();
+    else if (strcmp(user_input, "events clear") == 0)
+        event_count = 0;
+    // follow command: "follow [N M]" steps N half-steps per M external STEP pulses
+    else if (strncmp(user_input, "follow", 6) == 0) {
+        int numerator = 0;
+        int denominator = 0;
+        if (parse_follow_input(user_input, FOLLOW_MAX_RATIO, &numerator, &denominator))
+            follow(numerator, denominator);
+        else
+            invalid_input();
+    }
+    // encoder command: "encoder N" enables closed-loop checks with N counts per output revolution
+    else if (strcmp(user_input, "encoder off") == 0)
+        ini_encoder(0);
+    else if (parse_number_arg(user_input, "encoder", &number)) {
+        if (calibrated_rev <= 0)
+            printf("Calibrate first\r\n");
+        else if (number > 0 && number <= ENCODER_MAX_COUNTS)
+            ini_encoder(number);
+        else
+            invalid_input();
+    }
+    // stats command: profile cache effectiveness
+    else if (strcmp(user_input, "stats") == 0) {
+        int entries = 0;
+        for (int i = 0; i < PROFILE_CACHE_SIZE; i++)
+            entries += profile_cache[i].used;
+        printf("Profile cache: %u hits, %u misses, %d/%d entries\r\n", cache_hits, cache_misses, entries, PROFILE_CACHE_SIZE);
+    }
+    // capture commands: record command bytes and opto edges for replay in the host simulator
+    else if (strcmp(user_input, "capture on") == 0) {
+        capture_start();
+        printf("Capturing\r\n");
+    }
+    else if (strcmp(user_input, "capture off") == 0)
+        capture_stop();
+    else if (strcmp(user_input, "capture dump") == 0)
+        capture_dump();
+    else if (strcmp(user_input, "capture") == 0)
+        capture_status();
+    // home command: find slot 0 again without a full calibration
+    else if (strcmp(user_input, "home") == 0) {
+        if (calibrated_rev <= 0)
+            printf("Calibrate first\r\n");
+        else if (!home())
+            printf("Home failed\r\n");
+    }
+    // scan command: find resonant step rates the profile generator must not cruise at
+    else if (strcmp(user_input, "scan") == 0) {
+        if (calibrated_rev <= 0 || !position_valid)
+            printf("Calibrate first\r\n");
+        else if (filter_us == 0)
+            printf("Scan needs the opto filter (filter N)\r\n");
+        else if (!scan_resonance(steps_per_rev))
+            printf("Scan failed\r\n");
+    }
+    // sensor command: choose how calibration reads the opto fork
+    else if (strcmp(user_input, "sensor analog") == 0)
+        analog_sensing = true;
+    else if (strcmp(user_input, "sensor digital") == 0)
+        analog_sensing = false;
+    // calib command: "calib" or "calib N" measures N revolutions
+    else if (strncmp(user_input, "calib", 5) == 0) {
+        float revolution_steps[MAX_CALIB_SAMPLES]; // Step counts between consecutive edges
+        int calib_samples = 0;
+        int calib_rate = 0;
+        int attempt = 0;
+        bool accepted = false;
+        if (!parse_calib_input(user_input, &calib_samples, &calib_rate)) {
+            invalid_input();
+            return;
+        }
+        calibrated_rev = 0;
+        position_valid = false;
+        do {
+            // Safety limit to prevent infinite rotation: one extra revolution to find the first edge plus margin
+            const int safe_max = (calib_samples + 2) * SAFE_STEPS_PER_REV;
+            // Too few edges means the sensor is not seen at all, retrying will not help
+            if (calibrate(safe_max, revolution_steps, calib_samples, analog_sensing, 1000000u / calib_rate) < calib_samples)
+                break;
+            calib_statistics(revolution_steps, calib_samples, &stats);
+            printf("Median %.2f, mean %.2f, stddev %.2f, rejected %d\r\n",
+                   stats.median, stats.mean, stats.stddev, stats.rejected);
+            accepted = stats.stddev <= CALIB_MAX_STDDEV;
+            if (!accepted && attempt < CALIB_RETRIES)
+                printf("Spread too high, retrying\r\n");
+        } while (!accepted && attempt++ < CALIB_RETRIES);
+
+        if (accepted) {
+            // Update step count per revolution
+            calibrated_rev = stats.mean;
+            steps_per_rev = (int)lroundf(calibrated_rev);
+            position_valid = true;
+            printf("Calibration completed\r\n");
+        }
+        else {
+            // Calibration failed (too few edges detected or samples too scattered)
+            printf("Calibration failed\r\n");
+        }
+    }
+    // run command: "run" or "run N"
+    else if (strncmp(user_input, "run", 3) == 0) {
+        // Calibration required before running
+        if (calibrated_rev > 0 && position_valid) {
+            // If command is in form "run N"
+            if (validate_run_input(user_input)) {
+                // Extract numeric argument from "run N"
+                const int num_out = get_nums_from_a_string(user_input + 4);
+                // Run only if 0 < N <= RUN_MAX_SLOTS
+                if (num_out > 0 && num_out <= RUN_MAX_SLOTS)
+                    run_motor(num_out, steps_per_rev);
+                else
+                    invalid_input(); // Nonpositive or invalid number
             }
-            else
-                printf("Calibrate first\r\n");
+            // If command is plain "run" to rotate one full revolution (8 * 1/8)
+            else if (strlen(user_input) == 3)
+                run_motor(8, steps_per_rev);
         }
         else
+            printf("Calibrate first\r\n");
+    }
+    // goto command: "goto K" moves forward to slot K
+    else if (parse_number_arg(user_input, "goto", &number)) {
+        if (calibrated_rev <= 0 || !position_valid)
+            printf("Calibrate first\r\n");
+        else if (number >= SLOTS)
             invalid_input();
+        else {
+            // Forward only, so the approach is the same as when the slot was taught
+            const int steps = slot_offset(number, steps_per_rev) - offset_from_reference(steps_per_rev);
+            run_steps(steps < 0 ? steps + steps_per_rev : steps);
+        }
     }
+    // map command: "map" prints the slot table, "map K" teaches slot K at the current position
+    else if (strcmp(user_input, "map") == 0) {
+        for (int k = 0; k < SLOTS; k++) {
+            printf("Slot %d: %d steps (correction %d)\r\n", k, slot_offset(k, steps_per_rev), slot_correction[k]);
+        }
+    }
+    else if (strcmp(user_input, "map clear") == 0)
+        memset(slot_correction, 0, sizeof(slot_correction));
+    else if (parse_number_arg(user_input, "map", &number)) {
+        // Clamped before the arithmetic; out-of-range slots are rejected below
+        const int slot = number < SLOTS ? number : SLOTS;
+        // Slot 0 is the calibration edge itself; others must stay within a quarter slot of nominal
+        const int correction = offset_from_reference(steps_per_rev) - slot_steps(slot, steps_per_rev);
+        if (calibrated_rev <= 0 || !position_valid)
+            printf("Calibrate first\r\n");
+        else if (slot < 1 || slot >= SLOTS || abs(correction) > steps_per_rev / (SLOTS * 4))
+            invalid_input();
+        else {
+            slot_correction[slot] = (int16_t)correction;
+            printf("Slot %d: %d steps (correction %d)\r\n", slot, slot_offset(slot, steps_per_rev), correction);
+        }
+    }
+    // move command: "move D T" covers distance D in exactly T milliseconds
+    else if (strncmp(user_input, "move", 4) == 0) {
+        int steps = 0;
+        int duration_ms = 0;
+        move_profile profile;
+        // Distance units depend on the calibrated steps per revolution
+        if (calibrated_rev <= 0 || !position_valid)
+            printf("Calibrate first\r\n");
+        else if (!parse_move_input(user_input, steps_per_rev, &steps, &duration_ms))
+            invalid_input();
+        else {
+            // Negative distance runs in reverse; backlash take-up becomes the first steps of the ramp
+            const int dir = steps < 0 ? -1 : 1;
+            if (solve_timed_profile(abs(steps) + backlash_takeup(dir), duration_ms, &profile)) {
+                profile.dir = dir;
+                run_profile(&profile);
+            }
+        }
+    }
+    else
+        invalid_input();
 }
 
 void ini_coil_pins() {
     // Initialize all coil pins as outputs and set them LOW at startup
-    for (int i = 0; i < INS_SIZE; i++) {
-        gpio_init(coil_pins[i]);
-        gpio_set_dir(coil_pins[i], GPIO_OUT);
-        gpio_put(coil_pins[i], 0); // Ensure coils are off at startup
+    stepper_init();
+}
+
+void ini_aux_outputs() {
+    for (int i = 0; i < AUX_SIZE; i++) {
+        gpio_init(aux_pins[i]);
+        gpio_set_dir(aux_pins[i], GPIO_OUT);
+        gpio_put(aux_pins[i], 0);
+    }
+}
+
+void record_macro_line(const char *user_input) {
+    if (strcmp(user_input, "end") == 0) {
+        recording = false;
+        if (macro_save(macro_name, macro_text))
+            printf("Saved %s\r\n", macro_name);
+        else
+            printf("Macro not saved (table full or flash error)\r\n");
+        return;
+    }
+    // Keep room for the separator and terminator
+    if (strlen(macro_text) + strlen(user_input) + 2 > MACRO_TEXT_LENGTH) {
+        printf("Macro too long, line dropped\r\n");
+        return;
     }
+    strcat(macro_text, user_input);
+    strcat(macro_text, "\n");
+}
+
+void exec_macro(const char *name) {
+    const char *text = macro_find(name);
+    char line[INPUT_LENGTH];
+    if (text == NULL) {
+        printf("No macro %s\r\n", name);
+        return;
+    }
+    if (macro_depth >= MACRO_MAX_DEPTH) {
+        printf("Macros nested too deep\r\n");
+        return;
+    }
+    macro_depth++;
+    while (*text != '\0') {
+        // Copy one line out of the stored text
+        text = split_line(text, line);
+
+        printf("> %s\r\n", line);
+        const bool was_valid = position_valid;
+        handle_command(line);
+        // A stall leaves the wheel in an unknown place; the rest of the sequence must not run
+        if (was_valid && !position_valid) {
+            printf("Macro %s aborted\r\n", name);
+            break;
+        }
+    }
+    macro_depth--;
+}
+
+bool home() {
+    bool prev_state = gpio_get(SENSOR);
+    for (int i = 0; i < HOME_SEARCH_MAX; i++) {
+        step_motor(1);
+        sleep_us(safe_step_us());
+        const bool sensor_state = gpio_get(SENSOR);
+        // Falling edge is where calibration put slot 0
+        if (prev_state && !sensor_state) {
+            reference_position = position;
+            position_valid = true;
+            return true;
+        }
+        prev_state = sensor_state;
+    }
+    return false;
 }
 
 void ini_sensor() {
@@ -121,183 +817,1113 @@ void ini_sensor() {
     gpio_pull_up(SENSOR);
 }
 
-int calibrate(const int max, int revolution_steps[3]) {
+void start_adc_sampling() {
+    // GP28 reads LOW as a digital input while the ADC has it: keep the glitch filter from reporting that
+    if (filter_sm >= 0)
+        pio_sm_set_enabled(filter_pio, filter_sm, false);
+    // Hand GP28 over to the ADC; keep the pull-up the opto output relies on
+    adc_init();
+    adc_gpio_init(SENSOR);
+    gpio_pull_up(SENSOR);
+    adc_select_input(SENSOR_ADC_INPUT);
+    // Free-running conversions, each one pushed to the FIFO and requesting DMA
+    adc_fifo_setup(true, true, 1, false, false);
+    adc_set_clkdiv(ADC_CLKDIV);
+    memset(adc_ring, 0, sizeof(adc_ring));
+
+    // DMA copies every sample into the ring buffer, wrapping the write address
+    adc_dma_chan = dma_claim_unused_channel(true);
+    dma_channel_config cfg = dma_channel_get_default_config(adc_dma_chan);
+    channel_config_set_transfer_data_size(&cfg, DMA_SIZE_16);
+    channel_config_set_read_increment(&cfg, false);
+    channel_config_set_write_increment(&cfg, true);
+    channel_config_set_ring(&cfg, true, ADC_RING_BITS);
+    channel_config_set_dreq(&cfg, DREQ_ADC);
+    dma_channel_configure(adc_dma_chan, &cfg, adc_ring, &adc_hw->fifo, 0xffffffff, true);
+    adc_run(true);
+    // Let the ring fill before the first level is read
+    sleep_us(ADC_AVG_SAMPLES * 50 + 100);
+}
+
+void stop_adc_sampling() {
+    adc_run(false);
+    dma_channel_abort(adc_dma_chan);
+    dma_channel_unclaim(adc_dma_chan);
+    adc_dma_chan = -1;
+    adc_fifo_drain();
+    // Restore the digital input used by the default sensing mode
+    ini_sensor();
+    // Restart the glitch filter from the level the pin has now, dropping anything it saw meanwhile
+    if (filter_sm >= 0)
+        ini_opto_filter(filter_us);
+}
+
+int read_adc_level() {
+    // DMA write address points at the slot the next sample goes into
+    const uint32_t write_addr = dma_channel_hw_addr(adc_dma_chan)->write_addr;
+    const int head = (int)((write_addr - (uint32_t)(uintptr_t)adc_ring) / sizeof(adc_ring[0]));
+    int sum = 0;
+    for (int i = 1; i <= ADC_AVG_SAMPLES; i++) {
+        sum += adc_ring[(head - i) & (ADC_RING_SIZE - 1)];
+    }
+    return sum / ADC_AVG_SAMPLES;
+}
+
+void ini_opto_filter(const uint stable_us) {
+    // Load the program and hook up the interrupt the first time only
+    if (filter_sm < 0) {
+        filter_offset = pio_add_program(filter_pio, &opto_filter_program);
+        filter_sm = pio_claim_unused_sm(filter_pio, true);
+        pio_set_irq0_source_enabled(filter_pio, pis_sm0_rx_fifo_not_empty + filter_sm, true);
+        irq_set_exclusive_handler(PIO0_IRQ_0, opto_filter_irq);
+        irq_set_enabled(PIO0_IRQ_0, true);
+    }
+    // Stop the state machine and drop edges filtered with the old setting
+    pio_sm_set_enabled(filter_pio, filter_sm, false);
+    pio_sm_clear_fifos(filter_pio, filter_sm);
+    edge_tail = edge_head;
+    filter_us = stable_us;
+    if (stable_us > 0)
+        opto_filter_program_init(filter_pio, filter_sm, filter_offset, SENSOR, stable_us);
+}
+
+void opto_filter_irq() {
+    while (!pio_sm_is_rx_fifo_empty(filter_pio, filter_sm)) {
+        const bool level = pio_sm_get(filter_pio, filter_sm) != 0;
+        capture_edge(level, time_us_32() - last_step_us);
+        // The level has been stable for filter_us by the time it is reported
+        const uint64_t time_us = time_us_64() - filter_us;
+        const uint next = (edge_head + 1) & (EDGE_QUEUE_SIZE - 1);
+        // Drop the edge if the main loop has fallen a whole queue behind
+        if (next == edge_tail)
+            continue;
+        edge_queue[edge_head].time_us = time_us;
+        // Steps taken while the filter waited do not belong to the edge, in either direction
+        edge_queue[edge_head].position = position_at((uint32_t)time_us);
+        edge_queue[edge_head].level = level;
+        edge_head = next;
+    }
+}
+
+int position_at(const uint32_t time_us) {
+    // Undo the steps taken after the given time, newest first
+    int at = position;
+    for (uint k = 1; k <= STEP_HISTORY_SIZE && k <= step_head; k++) {
+        const volatile step_record *step = &step_history[(step_head - k) & (STEP_HISTORY_SIZE - 1)];
+        if ((int32_t)(time_us - step->time_us) >= 0)
+            break;
+        at = step->before;
+    }
+    return at;
+}
+
+void follower_irq() {
+    while (!pio_sm_is_rx_fifo_empty(filter_pio, follower_sm))
+        follower_pulses += pio_sm_get(filter_pio, follower_sm) & 2 ? 1 : -1;
+}
+
+void follow(const int numerator, const int denominator) {
+    // Load the program and hook up the interrupt the first time only
+    if (follower_sm < 0) {
+        gpio_init(STEP_IN);
+        gpio_init(DIR_IN);
+        const uint offset = pio_add_program(filter_pio, &step_follower_program);
+        follower_sm = pio_claim_unused_sm(filter_pio, true);
+        step_follower_program_init(filter_pio, follower_sm, offset, STEP_IN);
+        pio_set_irq1_source_enabled(filter_pio, pis_sm0_rx_fifo_not_empty + follower_sm, true);
+        irq_set_exclusive_handler(PIO0_IRQ_1, follower_irq);
+    }
+    pio_sm_clear_fifos(filter_pio, follower_sm);
+    follower_pulses = 0;
+    irq_set_enabled(PIO0_IRQ_1, true);
+    printf("Following STEP/DIR on GP%d/GP%d at %d:%d, press Enter to stop\r\n", STEP_IN, DIR_IN, numerator, denominator);
+
+    int followed = 0; // Steps taken towards the pulse count, without backlash take-up
+    const uint32_t step_us = (uint32_t)(1000000.0f / MAX_STEP_RATE);
+    // Runs until a whole line (usually just Enter) has been typed
+    while (getchar_timeout_us(0) != '\n') {
+        watchdog_update();
+        // Gear ratio applied to the whole count so rounding never accumulates
+        const int target = (int)((int64_t)follower_pulses * numerator / denominator);
+        if (target == followed || time_us_32() - last_step_us < step_us)
+            continue;
+        const int dir = target > followed ? 1 : -1;
+        // Steps crossing the gear play do not move the output; step_motor() keeps what is left of it
+        // across quick reversals, so a flip part-way only has the part already crossed to cross back
+        const bool takeup = backlash_takeup(dir) > 0;
+        step_motor(dir);
+        if (!takeup)
+            followed += dir;
+    }
+    irq_set_enabled(PIO0_IRQ_1, false);
+    printf("Followed %d pulses, %d steps\r\n", follower_pulses, followed);
+}
+
+void ini_encoder(const int counts) {
+    // Load the program and hook up the interrupt the first time only
+    if (encoder_sm < 0) {
+        gpio_init(ENC_A);
+        gpio_init(ENC_B);
+        // Open-collector encoders need the pull-ups
+        gpio_pull_up(ENC_A);
+        gpio_pull_up(ENC_B);
+        const uint offset = pio_add_program(encoder_pio, &quadrature_program);
+        encoder_sm = pio_claim_unused_sm(encoder_pio, true);
+        quadrature_program_init(encoder_pio, encoder_sm, offset, ENC_A);
+        pio_set_irq0_source_enabled(encoder_pio, pis_sm0_rx_fifo_not_empty + encoder_sm, true);
+        irq_set_exclusive_handler(PIO1_IRQ_0, encoder_irq);
+    }
+    irq_set_enabled(PIO1_IRQ_0, false);
+    // States queued before now belong to the old count; start again from the state the pins show
+    pio_sm_clear_fifos(encoder_pio, encoder_sm);
+    encoder_state = (int)gpio_get(ENC_A) | (int)gpio_get(ENC_B) << 1;
+    irq_set_enabled(PIO1_IRQ_0, counts > 0);
+    // Count from zero at the current position
+    encoder_count = 0;
+    encoder_origin = output_position();
+    encoder_counts = counts;
+}
+
+void encoder_irq() {
+    // Count change from the previous to the new state, indexed by previous * 4 + new.
+    // A leading B counts up; a jump over two states cannot be resolved and is not counted.
+    static const int8_t transition[16] = {0, 1, -1, 0, -1, 0, 0, 1, 1, 0, 0, -1, 0, -1, 1, 0};
+    while (!pio_sm_is_rx_fifo_empty(encoder_pio, encoder_sm)) {
+        const int state = (int)(pio_sm_get(encoder_pio, encoder_sm) & 3);
+        if (encoder_state >= 0)
+            encoder_count += transition[encoder_state * 4 + state];
+        encoder_state = state;
+    }
+}
+
+float following_error(const int dir) {
+    // Where the encoder says the output is, in steps since the encoder was zeroed
+    const float measured = (float)encoder_count * calibrated_rev / (float)encoder_counts;
+    return (float)dir * ((float)(output_position() - encoder_origin) - measured);
+}
+
+watch_result encoder_check(const int dir, int *missed) {
+    // A stepper loses steps but never gains them; the shaft seeming ahead is the backlash being taken up.
+    // The count only changes every calibrated_rev / encoder_counts steps, so up to one count is resolution
+    const float error = following_error(dir);
+    if (error <= calibrated_rev / (float)encoder_counts + ENCODER_ERROR_MARGIN)
+        return WATCH_OK;
+    // The step count ran ahead of the shaft: shift the reference by the lost steps and let the move make them up
+    *missed = (int)lroundf(error);
+    encoder_origin += dir * *missed;
+    reference_position += dir * *missed;
+    printf("Following error %d steps, corrected\r\n", *missed);
+    return WATCH_RECOVERED;
+}
+
+bool pop_opto_edge(opto_edge *edge) {
+    if (edge_tail == edge_head)
+        return false;
+    edge->time_us = edge_queue[edge_tail].time_us;
+    edge->position = edge_queue[edge_tail].position;
+    edge->level = edge_queue[edge_tail].level;
+    edge_tail = (edge_tail + 1) & (EDGE_QUEUE_SIZE - 1);
+    return true;
+}
+
+int calibrate(const int max, float revolution_steps[], const int samples, const bool analog, const uint32_t step_us) {
     int count = 0; // Number of falling edges detected
     int step = 0; // total half-steps taken
-    int edge_step = 0; // Steps between consecutive edges (starts after first edge)
-    bool first_edge_found = false;
+    float last_edge = 0; // Position (in steps) of the previous falling edge
+    float rising = -1; // Position of a rising edge found on this step, -1 if none
     bool continue_loop = true;
     bool prev_state = gpio_get(SENSOR); // true = no obstacle, false = obstacle
+    int prev_level = 0; // Previous ADC level in analog mode
+    const bool filtered = !analog && filter_us > 0; // Take edges from the PIO filter instead of raw reads
+    const int start_position = position;
+    opto_edge filtered_edge;
+    welford running = {0};
+
+    // Only edges seen during this calibration count
+    edge_tail = edge_head;
+
+    if (analog) {
+        start_adc_sampling();
+        prev_level = read_adc_level();
+        prev_state = prev_level > ADC_THRESHOLD;
+    }
 
     do {
         // Advance the motor by one half-step
-        step_motor();
-        sleep_ms(3);
+        step_motor(1);
+        sleep_us(step_us);
         step++;
 
-        // Start counting steps between edges after the first edge has been found
-        if (first_edge_found)
-            edge_step++;
+        float edge = -1; // Position of a falling edge found on this step, -1 if none
+        rising = -1;
+        if (analog) {
+            const int level = read_adc_level();
+            // Falling crossing: interpolate where between the previous and this step the level hit the threshold
+            if (prev_state && level <= ADC_THRESHOLD) {
+                edge = (float)(step - 1) + (float)(prev_level - ADC_THRESHOLD) / (float)(prev_level - level);
+                prev_state = false;
+            }
+            // Re-arm only once the level is clearly back above the threshold
+            else if (!prev_state && level > ADC_THRESHOLD + ADC_HYSTERESIS) {
+                rising = (float)step;
+                prev_state = true;
+            }
+            prev_level = level;
+        }
+        else if (filtered) {
+            // Filtered falling edges arrive with the step position they happened at
+            while (pop_opto_edge(&filtered_edge)) {
+                if (!filtered_edge.level && edge < 0)
+                    edge = (float)(filtered_edge.position - start_position);
+                else if (filtered_edge.level && rising < 0)
+                    rising = (float)(filtered_edge.position - start_position);
+            }
+        }
+        else {
+            const bool sensor_state = gpio_get(SENSOR);
+            // Detect falling edge: HIGH -> LOW transition (no obstacle -> obstacle)
+            if (prev_state && !sensor_state)
+                edge = (float)step;
+            else if (!prev_state && sensor_state)
+                rising = (float)step;
+            prev_state = sensor_state;
+        }
 
-        const bool sensor_state = gpio_get(SENSOR);
+        // Flag width: rising edge after a falling edge, used to expect a second edge per revolution
+        if (rising >= 0 && count > 0 && rising > last_edge)
+            rise_offset = (int)lroundf(rising - last_edge);
 
-        // Detect falling edge: HIGH -> LOW transition (no obstacle -> obstacle)
-        if (prev_state && !sensor_state) {
-            if (!first_edge_found) {
+        if (edge >= 0) {
+            if (count == 0) {
                 // First falling edge - start counting after this point
                 printf("First low edge found\r\n");
-                first_edge_found = true;
             }
             else {
                 // Store number of steps between consecutive edges
-                revolution_steps[count-1] = edge_step;
-                printf("%d. round steps: %d\r\n", count, edge_step);
-                edge_step = 0;
+                revolution_steps[count-1] = edge - last_edge;
+                welford_add(&running, revolution_steps[count-1]);
+                printf("%d. round steps: %.2f (mean %.2f, stddev %.2f)\r\n",
+                       count, revolution_steps[count-1], running.mean, welford_stddev(&running));
             }
+            last_edge = edge;
+            // Latest falling edge becomes the slot 0 reference
+            reference_position = start_position + (int)lroundf(edge);
             count++;
         }
-        // Stop after 4 falling edges (3 intervals) or reaching safety limit
-        if (count >= 4 || step > max)
+        // Stop after samples + 1 falling edges or reaching safety limit
+        if (count > samples || step > max)
             continue_loop = false;
 
-        prev_state = sensor_state;
-
     } while (continue_loop);
 
-    // At least 4 edges are required to compute 3 intervals (1 revolution)
-    if (count >= 4)
-        return get_avg(revolution_steps);
+    if (analog)
+        stop_adc_sampling();
+
+    // Number of complete revolutions measured (one less than the edges seen)
+    return count > 0 ? count - 1 : 0;
+}
+
+void step_motor(const int dir) {
+    // Determines which step phase (0–7 in half-step mode) the motor is currently in
+    // The phase count is a power of two, so the AND wraps reverse from 0 to the last phase
+    phase = (phase + dir) & (stepper_phases() - 1);
+    energize_coils(true);
+    const uint32_t now = time_us_32();
+    step_history[step_head & (STEP_HISTORY_SIZE - 1)].time_us = now;
+    step_history[step_head & (STEP_HISTORY_SIZE - 1)].before = position;
+    step_head++;
+    position += dir;
+    // Reversing part-way through the play leaves only the part already crossed to cross back
+    if (dir != last_direction)
+        takeup_left = backlash_steps - takeup_left;
+    if (takeup_left > 0)
+        takeup_left--;
+    last_direction = dir;
+    last_step_us = now;
+    capture_step(dir);
+    // Every step proves the motion engine is alive and keeps the reset-proof position current
+    watchdog_update();
+    save_step_state();
+    // Outputs switch right after the coils, within the same step
+    fire_events();
+}
+
+void fire_events() {
+    if (event_count == 0 || calibrated_rev <= 0 || !position_valid)
+        return;
+    // Backlash take-up does not move the output shaft (output_position() holds): fire only when it changes
+    const int offset = offset_from_reference(steps_per_rev);
+    if (offset == event_offset)
+        return;
+    event_offset = offset;
+    for (int i = 0; i < event_count; i++) {
+        if (events[i].offset == offset)
+            gpio_put(aux_pins[events[i].aux], events[i].level);
+    }
+}
+
+void list_events() {
+    if (event_count == 0)
+        printf("No output events\r\n");
+    for (int i = 0; i < event_count; i++)
+        printf("at %d: out %d %d\r\n", events[i].offset, events[i].aux, events[i].level);
+}
 
-    return 0; // Calibration failed
+void energize_coils(const bool on) {
+    // The coil pattern of every phase is resolved at compile time (stepper.hpp)
+    if (on)
+        stepper_energize(phase);
+    else
+        stepper_release();
 }
 
-void step_motor() {
-    // Half-step sequence for unipolar stepper motor
-    // Each row defines which coils (IN1–IN4) are energized for each step
-    const int half_step[8][4] = {
-        {1, 0, 0, 0}, // Step 1: A
-        {1, 1, 0, 0}, // Step 2: A + B
-        {0, 1, 0, 0}, // Step 3: B
-        {0, 1, 1, 0}, // Step 4: B + C
-        {0, 0, 1, 0}, // Step 5: C
-        {0, 0, 1, 1}, // Step 6: C + D
-        {0, 0, 0, 1}, // Step 7: D
-        {1, 0, 0, 1}  // Step 8: D + A
-    };
+int backlash_takeup(const int dir) {
+    // Reversing first has to cross the gear play before the output shaft moves, or what is left of it
+    return dir != last_direction ? backlash_steps - takeup_left : takeup_left;
+}
 
-    // Determines which step phase (0–7) the motor is currently in
-    // Bitwise AND preserves only the three lowest bits
-    static int phase = 0;
-    phase = phase + 1 & 7;
-    for (int i = 0; i < INS_SIZE; i++) {
-        gpio_put(coil_pins[i], half_step[phase][i]);
+bool step_until_level(const int dir, const bool level) {
+    for (int i = 0; i < BACKLASH_SEARCH_MAX; i++) {
+        if (gpio_get(SENSOR) == level)
+            return true;
+        step_motor(dir);
+        sleep_us(safe_step_us());
     }
+    return false;
 }
 
-int get_avg(const int revolution_steps[3]) {
+int measure_backlash() {
     int sum = 0;
-    for (int i = 0; i < 3; i++) {
-        sum += revolution_steps[i];
+    int measurements = 0;
+    int reverse_edge = 0;
+
+    // Start from an unblocked position so the first forward edge is a real HIGH -> LOW transition
+    if (!step_until_level(1, true))
+        return -1;
+    for (int i = 0; i < BACKLASH_CYCLES; i++) {
+        // Forward to the falling edge: first blocked reading
+        if (!step_until_level(1, false))
+            return -1;
+        const int forward_edge = position;
+        // Without backlash the reverse edge of the previous cycle is one step before this edge
+        if (i > 0) {
+            sum += forward_edge - 1 - reverse_edge;
+            measurements++;
+        }
+        // Push a little further into the blocked region, stopping early if the slot ends
+        for (int j = 0; j < BACKLASH_OVERTRAVEL && !gpio_get(SENSOR); j++) {
+            step_motor(1);
+            sleep_us(safe_step_us());
+        }
+        // Back out until the sensor is clear again: the same physical edge seen in reverse
+        if (!step_until_level(-1, false) || !step_until_level(-1, true))
+            return -1;
+        reverse_edge = position;
+        sum += forward_edge - 1 - reverse_edge;
+        measurements++;
     }
-    const int avg = sum / 3;
-    return avg;
+    // Play is the same in both directions; average the reversals in both senses
+    const int result = (sum + measurements / 2) / measurements;
+    return result > 0 ? result : 0;
+}
+
+void welford_add(welford *w, const float x) {
+    w->n++;
+    const float delta = x - w->mean;
+    w->mean += delta / (float)w->n;
+    w->m2 += delta * (x - w->mean);
+}
+
+float welford_stddev(const welford *w) {
+    if (w->n < 2)
+        return 0;
+    return sqrtf(w->m2 / (float)(w->n - 1));
+}
+
+void calib_statistics(const float revolution_steps[], const int n, calib_stats *stats) {
+    // Two-sided 95 % Student t values for 1..10 degrees of freedom, about 2.0 beyond that
+    const float t95[] = {12.71f, 4.30f, 3.18f, 2.78f, 2.57f, 2.45f, 2.36f, 2.31f, 2.26f, 2.23f};
+    float sorted[MAX_CALIB_SAMPLES];
+    float deviation[MAX_CALIB_SAMPLES];
+
+    // Median from an insertion-sorted copy
+    for (int i = 0; i < n; i++) {
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > revolution_steps[i]; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = revolution_steps[i];
+    }
+    const float median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+
+    // Median absolute deviation, scaled to match the standard deviation of normal data
+    for (int i = 0; i < n; i++) {
+        int j = i;
+        const float d = fabsf(sorted[i] - median);
+        for (; j > 0 && deviation[j - 1] > d; j--) {
+            deviation[j] = deviation[j - 1];
+        }
+        deviation[j] = d;
+    }
+    const float mad = 1.4826f * (n % 2 ? deviation[n / 2] : (deviation[n / 2 - 1] + deviation[n / 2]) / 2);
+    float limit = OUTLIER_MAD_SCALE * mad;
+    if (limit < OUTLIER_MIN_STEPS)
+        limit = OUTLIER_MIN_STEPS;
+
+    // Mean and spread of the samples that are close enough to the median
+    welford kept = {0};
+    for (int i = 0; i < n; i++) {
+        if (fabsf(revolution_steps[i] - median) <= limit)
+            welford_add(&kept, revolution_steps[i]);
+    }
+
+    stats->samples = n;
+    stats->rejected = n - kept.n;
+    stats->median = median;
+    stats->mean = kept.mean;
+    stats->stddev = welford_stddev(&kept);
+    stats->ci95 = kept.n > 1 ? (kept.n <= 11 ? t95[kept.n - 2] : 2.0f) * stats->stddev / sqrtf((float)kept.n) : 0;
 }
 
 void run_motor(const int count, const int steps_per_rev) {
-    // Calculate total number of half-steps:
-    const int i_count = count * (steps_per_rev / 8);
-    for (int i = 0; i < i_count; i++) {
-        step_motor();
-        sleep_ms(3);
+    // Land on the mapped position of the slot count slots ahead of the current one
+    const int steps = slot_offset(nearest_slot(steps_per_rev) + count, steps_per_rev) - offset_from_reference(steps_per_rev);
+    run_steps(steps);
+}
+
+void run_steps(const int steps) {
+    edge_watch watch;
+    int missed = 0;
+    int target = position + steps + backlash_takeup(1);
+    watch_begin(&watch, 1);
+    while (position < target) {
+        step_motor(1);
+        sleep_us(safe_step_us());
+        const watch_result result = watch_step(&watch, &missed);
+        if (result == WATCH_STALLED)
+            return;
+        // Lost steps have to be made up to land where the move was meant to
+        if (result == WATCH_RECOVERED)
+            target += missed;
     }
 }
 
-char *handle_input() {
-    // Static buffer for user input
-    static char string[INPUT_LENGTH];
-    bool stop_loop = false;
-    // Keep prompting until valid input is entered
-    while (!stop_loop) {
-        printf("Enter cmd: ");
-        fflush(stdout);
-        stop_loop = get_input(string);
+int output_position() {
+    // After reversing, the output trails the motor by the backlash in the other direction; while the play
+    // is being crossed the output stands still
+    return last_direction < 0 ? position + backlash_steps - takeup_left : position + takeup_left;
+}
+
+int offset_from_reference(const int steps_per_rev) {
+    const int offset = (output_position() - reference_position) % steps_per_rev;
+    return offset < 0 ? offset + steps_per_rev : offset;
+}
+
+int slot_offset(const int slot, const int steps_per_rev) {
+    // Nominal position plus the taught deviation of the slot within the revolution
+    const int k = slot % SLOTS;
+    return slot_steps(slot, steps_per_rev) + slot_correction[k];
+}
+
+int nearest_slot(const int steps_per_rev) {
+    const int offset = offset_from_reference(steps_per_rev);
+    int nearest = 0;
+    for (int k = 1; k <= SLOTS; k++) {
+        if (abs(slot_offset(k, steps_per_rev) - offset) < abs(slot_offset(nearest, steps_per_rev) - offset))
+            nearest = k;
     }
-    return string;
+    // Slot 8 (slot 0 of the next revolution) keeps targets ahead of an output just short of slot 0
+    return nearest;
 }
 
-bool get_input(char *user_input) {
-    // Read one line from stdin
-    if(fgets(user_input, INPUT_LENGTH, stdin)) {
-        // If no newline found, input exceeded buffer size -> discard remainder
-        if (strchr(user_input, '\n') == NULL) {
-            int c = 0;
-            while ((c = getchar()) != '\n' && c != EOF) {}
-            printf("Input too long (max %d characters).\r\n", INPUT_LENGTH-2);
-            return false;
+bool solve_timed_profile(const int steps, const int duration_ms, move_profile *profile) {
+    const profile_key key = {PROFILE_TIMED, steps, (float)duration_ms, 0, 0, MAX_ACCEL};
+    if (profile_cache_get(&key, profile))
+        return true;
+    const float a = MAX_ACCEL;
+    float t = (float)duration_ms / 1000.0f;
+    const float d = (float)steps;
+
+    // Shortest possible move: accelerate to the speed limit (or as far as the distance allows) and brake
+    float min_time = 2.0f * sqrtf(d / a);
+    if (d >= MAX_STEP_RATE * MAX_STEP_RATE / a)
+        min_time = d / MAX_STEP_RATE + MAX_STEP_RATE / a;
+    // Allow a tiny slack so requests at exactly the minimum time are not rejected by rounding
+    if (steps <= 0 || t < min_time * 0.9999f) {
+        printf("Infeasible move: needs at least %d ms\r\n", (int)ceilf(min_time * 1000.0f));
+        return false;
+    }
+
+    // With a symmetric trapezoid at full acceleration: t = d / v + v / a
+    // The slowest cruise rate that still finishes in time is the smaller root of v^2 - a*t*v + a*d = 0,
+    // in the form that does not cancel to 0 when a*t is much larger than the root
+    const float disc = a * a * t * t - 4.0f * a * d;
+    float v = 2.0f * a * d / (a * t + sqrtf(disc > 0.0f ? disc : 0.0f));
+    float accel = a;
+    if (v > MAX_STEP_RATE)
+        v = MAX_STEP_RATE;
+
+    // Never cruise inside a resonance band: cruise just above it and stretch the ramps to keep the duration,
+    // or if the distance is too short for that, ramp straight up and down through the band (triangle).
+    // A band reaching past the top speed leaves only its lower edge, at the cost of a longer move
+    int bin = resonance_bin(v);
+    if (bin >= 0 && resonance_bins & 1u << bin) {
+        while (bin < RES_BINS && resonance_bins & 1u << bin) {
+            bin++;
         }
-        // Remove trailing newline characters
-        trim_line(user_input);
-        // Reject empty input
-        if (user_input[0] == '\0') {
-            printf("Empty input.\r\n");
-            return false;
+        float above = RES_SCAN_MIN + (float)bin * RES_SCAN_STEP;
+        if (above > 2.0f * d / t)
+            above = 2.0f * d / t;
+        if (above <= MAX_STEP_RATE) {
+            v = above;
+            accel = v / (t - d / v);
+        }
+        else {
+            v = resonance_free_rate(v);
+            t = d / v + v / a;
+            printf("Cruising at %d steps/s below a resonance band, the move takes %d ms\r\n", (int)v,
+                   (int)ceilf(t * 1000.0f));
         }
-        return true;
     }
-    return false;
+
+    // Symmetric trapezoid from and to standstill
+    fill_segment_profile(steps, 0, v, 0, profile);
+    profile->accel = accel;
+    profile->accel_time = v / accel;
+    profile->accel_steps = v * v / (2.0f * accel);
+    profile->decel_steps = profile->accel_steps;
+    profile->total_time = t;
+    profile->ramp = ramp_table_find(accel);
+    profile_cache_put(&key, profile);
+    return true;
+}
+
+uint64_t profile_step_us(const move_profile *profile, const int step) {
+    const float s = (float)step;
+    const float a = profile->accel;
+    const float v0 = profile->entry_rate;
+    const float v1 = profile->exit_rate;
+    const ramp_table *ramp = profile->ramp;
+    // Accelerating: s = v0 * t + a * t^2 / 2, read from the preset table when starting from standstill
+    if (s <= profile->accel_steps) {
+        if (ramp != NULL && v0 == 0 && step < ramp->length)
+            return ramp->times_us[step];
+        return (uint64_t)((sqrtf(v0 * v0 + 2.0f * a * s) - v0) / a * 1000000.0f);
+    }
+    // Decelerating: mirror image of an acceleration from the exit rate, anchored at the end of the move
+    const int remaining = profile->steps - step;
+    // 64-bit so slow moves longer than 2^32 us (about 71 minutes) do not wrap
+    const uint64_t total_us = (uint64_t)(profile->total_time * 1000000.0f);
+    if ((float)remaining < profile->decel_steps) {
+        if (ramp != NULL && v1 == 0 && remaining < ramp->length)
+            return total_us - ramp->times_us[remaining];
+        return total_us - (uint64_t)((sqrtf(v1 * v1 + 2.0f * a * (float)remaining) - v1) / a * 1000000.0f);
+    }
+    // Cruising at constant rate
+    return (uint64_t)((profile->accel_time + (s - profile->accel_steps) / profile->cruise_rate) * 1000000.0f);
 }
 
-void trim_line(char *user_input) {
-    // Remove '\n' and '\r' characters from the end of the line
-    int len = (int)strlen(user_input);
-    while (len > 0 && (user_input[len - 1] == '\n' || user_input[len - 1] == '\r')) {
-        user_input[--len] = '\0';
+uint64_t run_profile(const move_profile *profile) {
+    edge_watch watch;
+    int missed = 0;
+    watch_begin(&watch, profile->dir);
+    // Where the move ends; retry steps taken by watch_step() count towards it
+    int target = position + profile->dir * profile->steps;
+    // Schedule every step against the move start so timing errors do not accumulate
+    const absolute_time_t start = get_absolute_time();
+    for (int i = 1; i <= profile->steps; i++) {
+        const absolute_time_t due = delayed_by_us(start, profile_step_us(profile, i));
+        // Slow moves can have steps further apart than the watchdog timeout
+        while (absolute_time_diff_us(get_absolute_time(), due) > WAIT_SLICE_MS * 1000) {
+            watchdog_update();
+            sleep_ms(WAIT_SLICE_MS);
+        }
+        sleep_until(due);
+        step_motor(profile->dir);
+        const watch_result result = watch_step(&watch, &missed);
+        if (result == WATCH_STALLED)
+            break;
+        // The schedule is broken after a retry; finish the rest, plus what was lost, at the safe rate
+        if (result == WATCH_RECOVERED) {
+            target += profile->dir * missed;
+            if (profile->dir > 0) {
+                run_steps(target - position);
+                break;
+            }
+            // Reverse moves are only corrected by the encoder, which keeps checking at the new rate
+            while (position > target && position_valid) {
+                step_motor(-1);
+                sleep_us(safe_step_us());
+                if (watch_step(&watch, &missed) == WATCH_RECOVERED)
+                    target -= missed;
+            }
+            break;
+        }
     }
+    return to_us_since_boot(start);
 }
 
-bool check_if_nums(const char *string) {
-    // Return true if all characters in string are digits
-    const int len = (int)strlen(string);
-    for (int i = 0; i < len; i++) {
-        if (!isdigit((unsigned char)string[i])) {
-            return false;
+void cruise_profile(const int steps, float rate, move_profile *profile) {
+    segment_profile(steps, 0, rate, 0, profile);
+}
+
+void segment_profile(const int steps, const float entry, const float rate, const float exit, move_profile *profile) {
+    const profile_key key = {PROFILE_SEGMENT, steps, rate, entry, exit, MAX_ACCEL};
+    if (profile_cache_get(&key, profile))
+        return;
+    // Cruise clear of resonance bands, but never below the rates the neighbouring segments join at
+    fill_segment_profile(steps, entry, fmaxf(resonance_free_rate(rate), fmaxf(entry, exit)), exit, profile);
+    profile_cache_put(&key, profile);
+}
+
+bool profile_cache_get(const profile_key *key, move_profile *profile) {
+    cache_clock++;
+    for (int i = 0; i < PROFILE_CACHE_SIZE; i++) {
+        const profile_key *k = &profile_cache[i].key;
+        if (profile_cache[i].used && k->mode == key->mode && k->steps == key->steps && k->speed == key->speed &&
+            k->entry == key->entry && k->exit == key->exit && k->accel == key->accel) {
+            profile_cache[i].last_used = cache_clock;
+            *profile = profile_cache[i].profile;
+            cache_hits++;
+            return true;
         }
     }
-    return true;
+    cache_misses++;
+    return false;
+}
+
+void profile_cache_put(const profile_key *key, const move_profile *profile) {
+    // Empty slots have last_used 0, so they are taken before any used one is replaced
+    int oldest = 0;
+    for (int i = 1; i < PROFILE_CACHE_SIZE; i++) {
+        if (profile_cache[i].last_used < profile_cache[oldest].last_used)
+            oldest = i;
+    }
+    profile_cache[oldest].used = true;
+    profile_cache[oldest].last_used = cache_clock;
+    profile_cache[oldest].key = *key;
+    profile_cache[oldest].profile = *profile;
 }
 
-int get_nums_from_a_string(const char *string) {
-    // Reject immediately if string starts with '0' (leading zeros not allowed)
-    if (string[0] != '0') {
-        const int len = (int)strlen(string);
-        char num_char[len + 1]; // buffer for numeric substring + null terminator
-        int j = 0;
-        // Collect digits into num_char
-        for (int i = 0; i < len; i++) {
-            if (isdigit((unsigned)string[i])) {
-                num_char[j++] = string[i];
+void profile_cache_clear() {
+    for (int i = 0; i < PROFILE_CACHE_SIZE; i++) {
+        profile_cache[i].used = false;
+        profile_cache[i].last_used = 0;
+    }
+}
+
+void fill_segment_profile(const int steps, const float entry, float rate, const float exit, move_profile *profile) {
+    const float a = MAX_ACCEL;
+    const float d = (float)steps;
+    float accel_steps = (rate * rate - entry * entry) / (2.0f * a);
+    float decel_steps = (rate * rate - exit * exit) / (2.0f * a);
+    // Too short to reach the rate: peak where the acceleration and deceleration curves meet
+    if (accel_steps + decel_steps > d) {
+        rate = sqrtf((2.0f * a * d + entry * entry + exit * exit) / 2.0f);
+        accel_steps = (rate * rate - entry * entry) / (2.0f * a);
+        decel_steps = d - accel_steps;
+    }
+    profile->steps = steps;
+    profile->dir = 1;
+    profile->accel = a;
+    profile->entry_rate = entry;
+    profile->cruise_rate = rate;
+    profile->exit_rate = exit;
+    profile->accel_steps = accel_steps;
+    profile->accel_time = (rate - entry) / a;
+    profile->decel_steps = decel_steps;
+    profile->total_time = profile->accel_time + (d - accel_steps - decel_steps) / rate + (rate - exit) / a;
+    profile->ramp = ramp_table_find(a);
+}
+
+void handle_gcode(const char *line) {
+    gcode_block block;
+    gcode_mode = true;
+    if (!gcode_parse(line, &block)) {
+        printf("error: bad line\r\n");
+        return;
+    }
+    if (block.has_f)
+        gcode_feed = block.f;
+    // A bare axis word repeats the modal G0/G1
+    if (block.letter == '\0' && block.has_x) {
+        block.letter = 'G';
+        block.code = gcode_motion;
+    }
+
+    if (block.letter == 'G' && (block.code == 0 || block.code == 1)) {
+        gcode_motion = block.code;
+        if (block.has_x) {
+            if (calibrated_rev <= 0 || !position_valid) {
+                printf("error: not calibrated\r\n");
+                return;
+            }
+            // Console commands move the motor behind the planner's back: go on from where the output is.
+            // A target that still matches keeps its fraction, so relative moves do not round every time
+            if (planner_count == 0 && (int)lroundf(gcode_target) != output_position())
+                gcode_target = (float)output_position();
+            // Degrees to steps; G0 moves at the speed limit, G1 at the feedrate
+            const float steps_per_degree = calibrated_rev / 360.0f;
+            const float target = block.x * steps_per_degree + (gcode_relative ? gcode_target : (float)gcode_origin);
+            const float rate = block.code == 0 ? MAX_STEP_RATE : gcode_feed / 60.0f * steps_per_degree;
+            if (!plan_gcode_move(target, rate)) {
+                printf("error: stall\r\n");
+                return;
             }
         }
-        // If at least one digit found, convert to integer
-        if (j > 0) {
-            num_char[j] = '\0';
-            return atoi(num_char);
+    }
+    else if (block.letter == 'G' && block.code == 90)
+        gcode_relative = false;
+    else if (block.letter == 'G' && block.code == 91)
+        gcode_relative = true;
+    else if (block.letter == 'G' && block.code == 28) {
+        run_planned(planner_count);
+        if (calibrated_rev <= 0 || !home()) {
+            printf("error: home failed\r\n");
+            return;
         }
+        gcode_origin = reference_position;
+        gcode_target = (float)gcode_origin;
+    }
+    // M17 / M18: coils on or off; M400: wait for buffered moves
+    else if (block.letter == 'M' && (block.code == 17 || block.code == 18 || block.code == 400)) {
+        run_planned(planner_count);
+        if (block.code != 400)
+            energize_coils(block.code == 17);
+    }
+    else if (block.letter == 'M' && block.code == 114) {
+        run_planned(planner_count);
+        const int steps = output_position() - gcode_origin;
+        printf("X:%.2f Count X:%d\r\n", calibrated_rev > 0 ? (float)steps * 360.0f / calibrated_rev : 0.0f, steps);
     }
-    return 0; // If no valid number found return 0
+    else if (block.letter != '\0') {
+        printf("error: unsupported %c%d\r\n", block.letter, block.code);
+        return;
+    }
+    printf("ok\r\n");
 }
 
-bool validate_run_input(const char *user_input) {
-    // Accept only form "run N"
-    // - at least 4 characters long starting from 0
-    // - 4th character is a space
-    // - after the space only digits are allowed
-    if (strlen(user_input) >= 4 && check_if_nums(user_input + 4) && user_input[3] == ' ')
+bool plan_gcode_move(const float target, float rate) {
+    // Start from standstill once nothing is buffered; handle_gcode() has synced gcode_target
+    if (planner_count == 0)
+        planner_entry = 0;
+    const int steps = (int)lroundf(target) - (int)lroundf(gcode_target);
+    gcode_target = target;
+    if (steps == 0)
         return true;
-    return false;
+    if (rate > MAX_STEP_RATE)
+        rate = MAX_STEP_RATE;
+    // Junction rates follow the move rates, so they stay out of the resonance bands too
+    rate = resonance_free_rate(rate);
+    if (planner_count == PLANNER_SIZE)
+        run_planned(1);
+    if (!position_valid) {
+        planner_count = 0;
+        return false;
+    }
+    planner[planner_count].steps = abs(steps);
+    planner[planner_count].dir = steps < 0 ? -1 : 1;
+    planner[planner_count].rate = rate;
+    planner_count++;
+    return true;
+}
+
+void run_planned(const int count) {
+    float entry_limit[PLANNER_SIZE]; // Highest rate each move may start at
+    move_profile profile;
+
+    // Backward pass: every move must be able to brake to the next one's limit, the last one to standstill
+    float next = 0;
+    for (int i = planner_count - 1; i >= 0; i--) {
+        const planned_move *m = &planner[i];
+        // Direction changes pass through standstill
+        const float junction = i > 0 && planner[i - 1].dir == m->dir ? fminf(planner[i - 1].rate, m->rate) : 0;
+        entry_limit[i] = fminf(junction, sqrtf(next * next + 2.0f * MAX_ACCEL * (float)m->steps));
+        next = entry_limit[i];
+    }
+
+    // Forward pass: run the moves, each one ending where the next may start
+    for (int i = 0; i < count && i < planner_count && position_valid; i++) {
+        const planned_move *m = &planner[i];
+        const float entry = i == 0 ? fminf(planner_entry, entry_limit[0]) : planner_entry;
+        const float reachable = sqrtf(entry * entry + 2.0f * MAX_ACCEL * (float)m->steps);
+        const float exit = i + 1 < planner_count ? fminf(entry_limit[i + 1], reachable) : 0;
+        segment_profile(m->steps + backlash_takeup(m->dir), entry, fmaxf(m->rate, fmaxf(entry, exit)), exit, &profile);
+        profile.dir = m->dir;
+        run_profile(&profile);
+        planner_entry = exit;
+    }
+
+    // Drop what was run; a stall drops everything
+    const int done = position_valid ? (count < planner_count ? count : planner_count) : planner_count;
+    memmove(planner, planner + done, (planner_count - done) * sizeof(planner[0]));
+    planner_count -= done;
+    if (planner_count == 0)
+        planner_entry = 0;
+}
+
+void input_idle(const int idle_ms) {
+    // The sender has gone quiet: nothing more to look ahead at, run what is buffered
+    if (planner_count > 0 && idle_ms >= GCODE_IDLE_MS)
+        run_planned(planner_count);
+}
+
+void watch_begin(edge_watch *w, const int dir) {
+    // Only forward moves with a known reference have predictable edges
+    w->enabled = stall_detection && position_valid && calibrated_rev > 0 && dir > 0;
+    w->prev_state = gpio_get(SENSOR);
+    w->dir = dir;
+    // The previous move's last edge is reported filter_us after it happened; let it arrive and drop it
+    // with the rest instead of taking it for a crossing of this move
+    const int32_t settle_us = (int32_t)(last_step_us + filter_us + EDGE_SETTLE_US - time_us_32());
+    if (filter_us > 0 && settle_us > 0)
+        sleep_us((uint64_t)settle_us);
+    edge_tail = edge_head;
+    if (w->enabled)
+        watch_expect_next(w, (float)output_position());
+}
+
+void watch_expect_next(edge_watch *w, const float from) {
+    // Where the output is within the current revolution, measured from the reference falling edge
+    float rel = fmodf(from - (float)reference_position, calibrated_rev);
+    if (rel < 0)
+        rel += calibrated_rev;
+    const float base = from - rel;
+    // Edges closer than the window may already have happened; expect the one after
+    if (rise_offset > 0 && rel + STALL_WINDOW < (float)rise_offset) {
+        w->expected = base + (float)rise_offset;
+        w->level = true;
+    }
+    else if (rel + STALL_WINDOW < calibrated_rev) {
+        w->expected = base + calibrated_rev;
+        w->level = false;
+    }
+    else if (rise_offset > 0) {
+        w->expected = base + calibrated_rev + (float)rise_offset;
+        w->level = true;
+    }
+    else {
+        w->expected = base + 2 * calibrated_rev;
+        w->level = false;
+    }
+}
+
+bool watch_edge(edge_watch *w, bool *level, int *edge_position) {
+    opto_edge edge;
+    if (filter_us > 0) {
+        if (!pop_opto_edge(&edge))
+            return false;
+        *level = edge.level;
+        *edge_position = edge.position;
+        return true;
+    }
+    const bool sensor_state = gpio_get(SENSOR);
+    if (sensor_state == w->prev_state)
+        return false;
+    w->prev_state = sensor_state;
+    *level = sensor_state;
+    *edge_position = position;
+    return true;
+}
+
+watch_result watch_step(edge_watch *w, int *missed) {
+    bool level;
+    int edge_position;
+    // Encoder feedback covers both directions and every step, the sensor only forward edges
+    if (encoder_counts > 0 && position_valid) {
+        const watch_result result = encoder_check(w->dir, missed);
+        if (result != WATCH_OK)
+            return result;
+    }
+    if (!w->enabled)
+        return WATCH_OK;
+
+    while (watch_edge(w, &level, &edge_position)) {
+        // Opposite edge: the one skipped at the start of the move, or noise
+        if (level != w->level)
+            continue;
+        if (fabsf((float)edge_position - w->expected) > STALL_WINDOW)
+            printf("Sensor edge %d steps off\r\n", (int)lroundf((float)edge_position - w->expected));
+        // Every falling edge re-anchors the reference so small errors do not add up
+        if (!level)
+            reference_position = edge_position;
+        watch_expect_next(w, (float)edge_position);
+    }
+    if ((float)position <= w->expected + STALL_WINDOW)
+        return WATCH_OK;
+
+    // Edge overdue: stop, let the rotor settle, then creep forward at the safe rate to find it
+    sleep_ms(STALL_SETTLE_MS);
+    for (int i = 0; i < STALL_RETRY_STEPS; i++) {
+        step_motor(1);
+        sleep_us(safe_step_us());
+        while (watch_edge(w, &level, &edge_position)) {
+            if (level != w->level)
+                continue;
+            *missed = (int)lroundf((float)edge_position - w->expected);
+            printf("Missed %d steps, recovered\r\n", *missed);
+            if (!level)
+                reference_position = edge_position;
+            watch_expect_next(w, (float)edge_position);
+            return WATCH_RECOVERED;
+        }
+    }
+    // Nothing moved past the sensor: stop for good until the unit is recalibrated
+    position_valid = false;
+    printf("Stall detected\r\n");
+    return WATCH_STALLED;
+}
+
+int resonance_bin(const float rate) {
+    if (rate < RES_SCAN_MIN)
+        return -1;
+    const int bin = (int)((rate - RES_SCAN_MIN) / RES_SCAN_STEP);
+    return bin < RES_BINS ? bin : -1;
+}
+
+float resonance_free_rate(const float rate) {
+    int above = resonance_bin(rate);
+    if (above < 0 || !(resonance_bins & 1u << above))
+        return rate;
+    int below = above;
+    while (above < RES_BINS && resonance_bins & 1u << above) {
+        above++;
+    }
+    while (below >= 0 && resonance_bins & 1u << below) {
+        below--;
+    }
+    // Just above the band if the motor can go that fast, otherwise just below it
+    const float up = RES_SCAN_MIN + (float)above * RES_SCAN_STEP;
+    return up <= MAX_STEP_RATE ? up : RES_SCAN_MIN + (float)(below + 1) * RES_SCAN_STEP - 1.0f;
+}
+
+uint32_t safe_step_us() {
+    return (uint32_t)(1000000.0f / resonance_free_rate(SAFE_STEP_RATE));
+}
+
+bool scan_resonance(const int steps_per_rev) {
+    move_profile profile;
+    opto_edge edge;
+    uint32_t found = 0;
+    const bool detection = stall_detection;
+    const int counts = encoder_counts;
+    const uint32_t previous_bins = resonance_bins;
+
+    // Start half a revolution from the reference so the sensor edge is passed mid-move, at cruise rate
+    run_steps((slot_offset(SLOTS / 2, steps_per_rev) - offset_from_reference(steps_per_rev) + steps_per_rev) % steps_per_rev);
+
+    // Missed steps are what the scan looks for; neither the stall check nor the encoder must correct them,
+    // and the old bands must not move the scanned rates
+    stall_detection = false;
+    ini_encoder(0);
+    resonance_bins = 0;
+    profile_cache_clear();
+    for (int bin = 0; bin < RES_BINS; bin++) {
+        const float rate = RES_SCAN_MIN + ((float)bin + 0.5f) * RES_SCAN_STEP;
+        const float period_us = 1000000.0f / rate;
+        int falling_seen = 0;
+        float min_lag = 0;
+        float max_lag = 0;
+
+        // Each revolution passes the falling edge once, at the same point of the cruise
+        cruise_profile(RES_SCAN_REVS * steps_per_rev, rate, &profile);
+        edge_tail = edge_head;
+        const int start_position = position;
+        const uint64_t start_us = run_profile(&profile);
+
+        // Lag of each falling edge behind the time its step was commanded
+        while (pop_opto_edge(&edge)) {
+            if (edge.level)
+                continue;
+            const int step = edge.position - start_position;
+            const float lag = (float)(edge.time_us - start_us) - (float)profile_step_us(&profile, step);
+            // Revolution length since the previous reference edge tells how many steps were lost
+            const int missed = edge.position - reference_position - steps_per_rev;
+            if (abs(missed) > RES_MISSED_STEPS)
+                found |= 1u << bin;
+            reference_position = edge.position;
+            min_lag = falling_seen == 0 || lag < min_lag ? lag : min_lag;
+            max_lag = falling_seen == 0 || lag > max_lag ? lag : max_lag;
+            falling_seen++;
+        }
+        // A lost reference means the rotor did not follow at all
+        if (falling_seen == 0) {
+            stall_detection = detection;
+            resonance_bins = previous_bins;
+            profile_cache_clear();
+            if (counts > 0)
+                ini_encoder(counts);
+            position_valid = false;
+            return false;
+        }
+        // The same edge seen at varying delays: the rotor oscillates around its commanded position
+        if (max_lag - min_lag > RES_JITTER_PERIODS * period_us)
+            found |= 1u << bin;
+        printf("%d steps/s: %s\r\n", (int)rate, found & 1u << bin ? "resonant" : "ok");
+    }
+    stall_detection = detection;
+    resonance_bins = found;
+    // The encoder counts from here again: steps lost during the scan are not a following error
+    if (counts > 0)
+        ini_encoder(counts);
+    // Timed profiles avoid the flagged bands, so the ones computed before the scan are stale
+    profile_cache_clear();
+    return true;
+}
+
+char *handle_input() {
+    // Static buffer for user input
+    static char string[INPUT_LENGTH];
+    bool stop_loop = false;
+    // Keep prompting until valid input is entered
+    while (!stop_loop) {
+        // G-code senders expect nothing but responses
+        if (!gcode_mode) {
+            printf("Enter cmd: ");
+            fflush(stdout);
+        }
+        stop_loop = get_input(string);
+    }
+    return string;
+}
+
+bool get_input(char *user_input) {
+    input_line line;
+    input_line_reset(&line);
+    absolute_time_t last_char = get_absolute_time();
+    // Read one line from stdin, polling so buffered G-code moves can run while the sender is quiet
+    while (true) {
+        const int c = getchar_timeout_us(INPUT_POLL_US);
+        // Waiting for input is the idle loop: it feeds the watchdog too
+        watchdog_update();
+        if (c == PICO_ERROR_TIMEOUT) {
+            input_idle((int)(absolute_time_diff_us(last_char, get_absolute_time()) / 1000));
+            continue;
+        }
+        last_char = get_absolute_time();
+        capture_input(c);
+        if (input_line_add(&line, c))
+            break;
+    }
+    strcpy(user_input, line.text);
+    // Input exceeded buffer size -> the remainder has been discarded
+    if (line.too_long) {
+        printf("Input too long (max %d characters).\r\n", INPUT_LENGTH-2);
+        return false;
+    }
+    // Remove trailing newline characters
+    trim_line(user_input);
+    // Reject empty input
+    if (user_input[0] == '\0') {
+        printf("Empty input.\r\n");
+        return false;
+    }
+    return true;
 }
 
 void invalid_input() {
     printf("Invalid input\r\n");
-    printf("Allowed commands: status, calib, run N\r\n");
+    printf("Allowed commands: status, calib [N [R]], run N, move [-]D[s|d] T, sensor analog|digital, filter N, backlash, goto K, map [K|clear], scan, stall on|off,\r\n");
+    printf("                  def NAME ... end, exec NAME, macros, undef NAME, wait MS, out K 0|1, at P K 0|1, events [clear], follow [N M], encoder N|off,\r\n");
+    printf("                  stats, capture [on|off|dump], home, G-code (G0/G1 X F, G28, G90/G91, M17/M18, M114)\r\n");
 }
\ No newline at end of file
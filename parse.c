@@ -0,0 +1,233 @@
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "parse.h"
+
+#define MOVE_MAX_STEPS 1000000 // Longest accepted "move" (half-steps), far beyond any real move
+
+void input_line_reset(input_line *line) {
+    line->text[0] = '\0';
+    line->len = 0;
+    line->too_long = false;
+}
+
+bool input_line_add(input_line *line, const int c) {
+    if (c == '\n') {
+        line->text[line->len] = '\0';
+        return true;
+    }
+    // Keep room for the terminator like fgets() with a newline would
+    if (line->len < INPUT_LENGTH - 2)
+        line->text[line->len++] = (char)c;
+    else
+        line->too_long = true;
+    return false;
+}
+
+void trim_line(char *user_input) {
+    // Remove '\n' and '\r' characters from the end of the line
+    int len = (int)strlen(user_input);
+    while (len > 0 && (user_input[len - 1] == '\n' || user_input[len - 1] == '\r')) {
+        user_input[--len] = '\0';
+    }
+}
+
+bool check_if_nums(const char *string) {
+    // Return true if all characters in string are digits
+    const int len = (int)strlen(string);
+    for (int i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)string[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int get_nums_from_a_string(const char *string) {
+    // Reject immediately if string starts with '0' (leading zeros not allowed)
+    if (string[0] == '0')
+        return 0;
+    // Form the number from the digits as they come, no copy of the string needed
+    int value = 0;
+    for (int i = 0; string[i] != '\0'; i++) {
+        if (!isdigit((unsigned char)string[i]))
+            continue;
+        const int digit = string[i] - '0';
+        // Saturate instead of overflowing; every caller range-checks the result
+        if (value > (INT_MAX - digit) / 10)
+            return INT_MAX;
+        value = value * 10 + digit;
+    }
+    return value; // 0 if no digits found
+}
+
+bool validate_run_input(const char *user_input) {
+    // Accept only form "run N"
+    // - at least 4 characters long starting from 0
+    // - 4th character is a space
+    // - after the space only digits are allowed
+    if (strlen(user_input) >= 4 && check_if_nums(user_input + 4) && user_input[3] == ' ')
+        return true;
+    return false;
+}
+
+int slot_steps(const int slots, const int steps_per_rev) {
+    // Rounded once from the exact N/8 revolutions, so "move N" and slot targets never drift apart
+    const int64_t eighths = (int64_t)slots * steps_per_rev;
+    return (int)((eighths + (eighths < 0 ? -SLOTS / 2 : SLOTS / 2)) / SLOTS);
+}
+
+bool parse_move_input(const char *user_input, const int steps_per_rev, int *steps, int *duration_ms) {
+    // Accept only form "move D T" where D is a number with an optional '-' for reverse and unit suffix:
+    // - no suffix: 1/8 revolutions (same unit as "run N")
+    // - 's': half-steps
+    // - 'd': degrees
+    // and T is the move duration in milliseconds
+    char distance[INPUT_LENGTH];
+    if (strlen(user_input) < 8 || user_input[4] != ' ')
+        return false;
+    const char *space = strchr(user_input + 5, ' ');
+    if (space == NULL)
+        return false;
+
+    // Split distance token and separate the unit suffix
+    int len = (int)(space - (user_input + 5));
+    if (len <= 0 || len >= INPUT_LENGTH)
+        return false;
+    memcpy(distance, user_input + 5, len);
+    distance[len] = '\0';
+    char unit = '\0';
+    int sign = 1;
+    if (distance[len - 1] == 's' || distance[len - 1] == 'd') {
+        unit = distance[len - 1];
+        distance[--len] = '\0';
+    }
+    if (distance[0] == '-') {
+        sign = -1;
+        memmove(distance, distance + 1, len--);
+    }
+    if (len == 0 || !check_if_nums(distance) || !check_if_nums(space + 1))
+        return false;
+
+    const int amount = get_nums_from_a_string(distance);
+    *duration_ms = get_nums_from_a_string(space + 1);
+    if (amount <= 0 || *duration_ms <= 0)
+        return false;
+
+    // Convert in floating point so huge distances are rejected instead of overflowing
+    float steps_f = (float)amount * (float)steps_per_rev / SLOTS;
+    if (unit == 's')
+        steps_f = (float)amount;
+    else if (unit == 'd')
+        steps_f = roundf((float)amount * (float)steps_per_rev / 360.0f);
+    if (steps_f <= 0 || steps_f > MOVE_MAX_STEPS)
+        return false;
+    *steps = unit == '\0' ? slot_steps(amount, steps_per_rev) : (int)steps_f;
+    *steps *= sign;
+    return true;
+}
+
+bool parse_calib_input(const char *user_input, int *samples, int *rate) {
+    // Accept "calib", "calib N" or "calib N R": N revolutions (1..MAX_CALIB_SAMPLES) at R steps/s
+    *samples = DEFAULT_CALIB_SAMPLES;
+    *rate = DEFAULT_CALIB_RATE;
+    if (strcmp(user_input, "calib") == 0)
+        return true;
+    if (strncmp(user_input, "calib ", 6) != 0 || strlen(user_input + 6) >= INPUT_LENGTH)
+        return false;
+    char count[INPUT_LENGTH];
+    strcpy(count, user_input + 6);
+    // Optional rate after the revolution count
+    char *space = strchr(count, ' ');
+    if (space != NULL) {
+        *space = '\0';
+        if (space[1] == '\0' || !check_if_nums(space + 1))
+            return false;
+        *rate = get_nums_from_a_string(space + 1);
+    }
+    if (count[0] == '\0' || !check_if_nums(count))
+        return false;
+    *samples = get_nums_from_a_string(count);
+    return *samples >= 1 && *samples <= MAX_CALIB_SAMPLES && *rate >= MIN_CALIB_RATE && *rate <= MAX_CALIB_RATE;
+}
+
+bool parse_number_arg(const char *user_input, const char *keyword, int *value) {
+    // Accept only form "KEYWORD N"; leading zeros are allowed, callers range-check the value
+    const size_t len = strlen(keyword);
+    if (strncmp(user_input, keyword, len) != 0 || user_input[len] != ' ')
+        return false;
+    const char *digits = user_input + len + 1;
+    if (digits[0] == '\0' || !check_if_nums(digits))
+        return false;
+    *value = 0;
+    for (int i = 0; digits[i] != '\0'; i++) {
+        const int digit = digits[i] - '0';
+        if (*value > (INT_MAX - digit) / 10) {
+            *value = INT_MAX;
+            return true;
+        }
+        *value = *value * 10 + digit;
+    }
+    return true;
+}
+
+bool parse_out_input(const char *user_input, const int aux_count, int *aux, bool *level) {
+    // Accept only form "out K 0|1" with a single-digit output number
+    if (strncmp(user_input, "out ", 4) != 0 || strlen(user_input) != 7 || user_input[5] != ' ')
+        return false;
+    *aux = user_input[4] - '0';
+    *level = user_input[6] == '1';
+    return *aux >= 0 && *aux < aux_count && (user_input[6] == '0' || user_input[6] == '1');
+}
+
+bool parse_event_input(const char *user_input, const int steps_per_rev, const int aux_count, int *offset, int *aux, bool *level) {
+    // Accept only form "at P K 0|1" where P is the half-step offset from slot 0
+    char number[INPUT_LENGTH];
+    const int len = (int)strlen(user_input);
+    if (len < 8 || len >= INPUT_LENGTH || strncmp(user_input, "at ", 3) != 0 || user_input[len - 4] != ' ' ||
+        user_input[len - 2] != ' ')
+        return false;
+    const int offset_len = len - 7;
+    memcpy(number, user_input + 3, offset_len);
+    number[offset_len] = '\0';
+    if (!check_if_nums(number))
+        return false;
+    *offset = strcmp(number, "0") == 0 ? 0 : get_nums_from_a_string(number);
+    *aux = user_input[len - 3] - '0';
+    *level = user_input[len - 1] == '1';
+    return (*offset > 0 || strcmp(number, "0") == 0) && *offset < steps_per_rev &&
+           *aux >= 0 && *aux < aux_count && (user_input[len - 1] == '0' || user_input[len - 1] == '1');
+}
+
+bool parse_follow_input(const char *user_input, const int max_ratio, int *numerator, int *denominator) {
+    // Accept "follow" for 1:1 or "follow N M" for N motor half-steps per M pulses
+    *numerator = 1;
+    *denominator = 1;
+    if (strcmp(user_input, "follow") == 0)
+        return true;
+    char ratio[INPUT_LENGTH];
+    if (strncmp(user_input, "follow ", 7) != 0 || strlen(user_input + 7) >= INPUT_LENGTH)
+        return false;
+    strcpy(ratio, user_input + 7);
+    char *space = strchr(ratio, ' ');
+    if (space == NULL)
+        return false;
+    *space = '\0';
+    if (!check_if_nums(ratio) || !check_if_nums(space + 1))
+        return false;
+    *numerator = get_nums_from_a_string(ratio);
+    *denominator = get_nums_from_a_string(space + 1);
+    return *numerator > 0 && *numerator <= max_ratio && *denominator > 0 && *denominator <= max_ratio;
+}
+
+const char *split_line(const char *text, char *line) {
+    // Lines longer than the input buffer are cut like the serial input would cut them
+    const char *newline = strchr(text, '\n');
+    const int len = newline != NULL ? (int)(newline - text) : (int)strlen(text);
+    const int kept = len < INPUT_LENGTH ? len : INPUT_LENGTH - 1;
+    memcpy(line, text, kept);
+    line[kept] = '\0';
+    return newline != NULL ? newline + 1 : text + len;
+}
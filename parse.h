@@ -0,0 +1,36 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stdbool.h>
+
+#define INPUT_LENGTH 32 // Maximum input line length
+#define DEFAULT_CALIB_SAMPLES 3 // Revolutions measured by plain "calib"
+#define MAX_CALIB_SAMPLES 32 // Upper limit for "calib N"
+#define DEFAULT_CALIB_RATE 333 // Calibration step rate (steps/s) without "calib N R": one step per 3 ms
+#define MIN_CALIB_RATE 50 // Slowest "calib N R"
+#define MAX_CALIB_RATE 800 // Fastest "calib N R", the motor's maximum step rate
+#define SLOTS 8 // Dispenser slots per revolution; "run N" and "move N" move N slots
+
+// Serial input line being assembled one character at a time
+typedef struct {
+    char text[INPUT_LENGTH]; // Characters received so far, terminated once the line is complete
+    int len; // Characters stored in text
+    bool too_long; // Characters were dropped because the line did not fit
+} input_line;
+
+void input_line_reset(input_line *line); // Start a new empty line
+bool input_line_add(input_line *line, int c); // Add one received character, true when it completed the line
+void trim_line(char *user_input); // Remove '\n' and '\r' characters from the end of a string
+bool check_if_nums(const char *string); // Return true if the string contains only digits (0–9)
+int get_nums_from_a_string(const char *string); // Extract digits from a string, form an integer (rejects leading zeros)
+bool validate_run_input(const char *user_input); // Validate that "run" command has a proper numeric argument ("run N")
+int slot_steps(int slots, int steps_per_rev); // Nominal half-steps from slot 0 to slot N, rounded once
+bool parse_move_input(const char *user_input, int steps_per_rev, int *steps, int *duration_ms); // Parse "move [-]D[s|d] T" into half-steps and milliseconds
+bool parse_calib_input(const char *user_input, int *samples, int *rate); // Parse "calib", "calib N" or "calib N R" into revolutions and steps/s
+bool parse_number_arg(const char *user_input, const char *keyword, int *value); // Parse "KEYWORD N" with N all digits, saturating at INT_MAX
+bool parse_out_input(const char *user_input, int aux_count, int *aux, bool *level); // Parse "out K 0|1"
+bool parse_event_input(const char *user_input, int steps_per_rev, int aux_count, int *offset, int *aux, bool *level); // Parse "at P K 0|1"
+bool parse_follow_input(const char *user_input, int max_ratio, int *numerator, int *denominator); // Parse "follow" or "follow N M"
+const char *split_line(const char *text, char *line); // Copy the first '\n'-separated line of text into line[INPUT_LENGTH], return the rest
+
+#endif
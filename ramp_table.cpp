@@ -0,0 +1,48 @@
+#include <array>
+#include <cstddef>
+#include "ramp_table.h"
+
+namespace {
+
+// Newton iteration; std::sqrt is not constexpr in C++17
+constexpr double const_sqrt(double x) {
+    if (x <= 0)
+        return 0;
+    double root = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++)
+        root = 0.5 * (root + x / root);
+    return root;
+}
+
+// Steps needed to reach the rate from standstill, plus the step at t = 0
+constexpr std::size_t ramp_length(int accel, int rate) {
+    return (std::size_t)rate * rate / (2 * (std::size_t)accel) + 2;
+}
+
+// s = a * t^2 / 2, so step k is taken at t = sqrt(2k / a)
+template <int Accel, int Rate>
+constexpr std::array<uint32_t, ramp_length(Accel, Rate)> make_ramp() {
+    std::array<uint32_t, ramp_length(Accel, Rate)> times{};
+    for (std::size_t k = 0; k < times.size(); k++)
+        times[k] = (uint32_t)(1000000.0 * const_sqrt(2.0 * (double)k / Accel) + 0.5);
+    return times;
+}
+
+// Presets: the accelerations the motion engine uses. Const data stays in flash (XIP), not in RAM.
+constexpr auto full_accel = make_ramp<(int)MAX_ACCEL, (int)MAX_STEP_RATE>();
+
+constexpr ramp_table presets[] = {
+    {MAX_ACCEL, (int)full_accel.size(), full_accel.data()},
+};
+
+static_assert(full_accel[1] == 31623, "first step at sqrt(2 / a) s");
+
+}
+
+const ramp_table *ramp_table_find(const float accel) {
+    for (const ramp_table &preset : presets) {
+        if (preset.accel == accel)
+            return &preset;
+    }
+    return nullptr;
+}
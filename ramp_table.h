@@ -0,0 +1,27 @@
+#ifndef RAMP_TABLE_H
+#define RAMP_TABLE_H
+
+#include <stdint.h>
+
+// Motion limits, shared by the profile generator and the ramp tables built from them
+#define MAX_STEP_RATE 800.0f // Maximum half-step rate (steps/s)
+#define MAX_ACCEL 2000.0f // Maximum acceleration and deceleration (steps/s^2)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Step times of an acceleration from standstill, generated at compile time and kept in flash
+typedef struct {
+    float accel; // Acceleration the table was generated for (steps/s^2)
+    int length; // Entries in times_us; covers a ramp up to MAX_STEP_RATE
+    const uint32_t *times_us; // times_us[k]: microseconds from standstill to step k
+} ramp_table;
+
+const ramp_table *ramp_table_find(float accel); // Preset table for the acceleration, NULL if there is none
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
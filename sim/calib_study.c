@@ -0,0 +1,340 @@
+// Monte Carlo study of calibration accuracy: runs "calib N R" many times in the simulator against
+// randomised mechanics and reports the steps-per-revolution error for each sample count and step rate.
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "model.h"
+#include "sim.h"
+
+#define MAX_LIST 16 // Entries in --samples and --rates
+#define OUTPUT_SIZE 8192 // Console output kept per trial
+#define MAX_JOBS 256 // Largest --jobs
+
+int firmware_main(void); // main() of main.c, renamed by the build
+
+// Range a parameter is drawn from, uniformly
+typedef struct {
+    double min;
+    double max;
+} range;
+
+// Settings shared by all trials
+typedef struct {
+    range steps_per_rev;
+    range slot_width;
+    double edge_jitter;
+    double miss_rate;
+    double pullout_rate;
+    bool analog;
+    uint64_t seed;
+} study_config;
+
+// One simulated calibration
+typedef struct {
+    model_params params; // Mechanics of this trial
+    int samples;
+    int rate;
+    bool completed; // "Calibration completed"
+    double error; // Calibrated minus true steps per revolution
+    double time_s; // Virtual time the calibration took
+} trial;
+
+// Running child process of a trial
+typedef struct {
+    pid_t pid;
+    int fd; // Read end of the child's console
+    trial *t;
+    char output[OUTPUT_SIZE];
+    size_t length;
+} job;
+
+static uint64_t next_random(uint64_t *state); // splitmix64
+static double draw(range r, uint64_t *state); // Uniform value from the range
+static bool parse_range(const char *text, range *r); // "MIN:MAX" or a single value
+static int parse_list(const char *text, int list[]); // "1,2,3", number of entries or 0
+static bool start_trial(job *j, trial *t, const study_config *config); // Fork the simulator for one trial
+static void finish_trial(job *j); // Reap the child and read the result from its console
+static void run_trials(trial trials[], int count, int jobs, const study_config *config); // Keep up to jobs trials running
+static void report_cell(const trial trials[], int count, double spec, double *time_s, bool *meets); // Print one table row
+static int compare_double(const void *a, const void *b); // qsort order
+static void print_time(void); // Child: report when the calibration finished, at exit
+static void usage(const char *name); // Print the options
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"trials", required_argument, NULL, 't'},
+        {"samples", required_argument, NULL, 'n'},
+        {"rates", required_argument, NULL, 'r'},
+        {"sensor", required_argument, NULL, 'a'},
+        {"steps-per-rev", required_argument, NULL, 'g'},
+        {"slot-width", required_argument, NULL, 'w'},
+        {"edge-jitter", required_argument, NULL, 'j'},
+        {"miss-rate", required_argument, NULL, 'm'},
+        {"pullout", required_argument, NULL, 'P'},
+        {"spec", required_argument, NULL, 'e'},
+        {"jobs", required_argument, NULL, 'p'},
+        {"seed", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    study_config config = {{4090.0, 4100.0}, {1900.0, 1900.0}, 0.5, 0.0, 1600.0, false, 1};
+    int trials_per_cell = 200;
+    int samples[MAX_LIST] = {1, 2, 3, 5, 8};
+    int sample_count = 5;
+    int rates[MAX_LIST] = {100, 200, 333, 500, 800};
+    int rate_count = 5;
+    double spec = 1.0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int jobs = cpus > 0 ? (int)cpus : 1;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 't': trials_per_cell = atoi(optarg); ok = trials_per_cell > 0; break;
+            case 'n': sample_count = parse_list(optarg, samples); ok = sample_count > 0; break;
+            case 'r': rate_count = parse_list(optarg, rates); ok = rate_count > 0; break;
+            case 'a': config.analog = strcmp(optarg, "analog") == 0; ok = config.analog || strcmp(optarg, "digital") == 0; break;
+            case 'g': ok = parse_range(optarg, &config.steps_per_rev); break;
+            case 'w': ok = parse_range(optarg, &config.slot_width); break;
+            case 'j': config.edge_jitter = atof(optarg); break;
+            case 'm': config.miss_rate = atof(optarg); break;
+            case 'P': config.pullout_rate = atof(optarg); ok = config.pullout_rate >= 0; break;
+            case 'e': spec = atof(optarg); break;
+            case 'p': jobs = atoi(optarg); ok = jobs > 0 && jobs <= MAX_JOBS; break;
+            case 'd': config.seed = strtoull(optarg, NULL, 10); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (jobs > MAX_JOBS)
+        jobs = MAX_JOBS;
+
+    printf("Steps/rev %.1f..%.1f, slot width %.0f..%.0f, edge jitter %.2f, miss rate %g, pull-out %.0f steps/s, %s sensor, %d trials each\n",
+           config.steps_per_rev.min, config.steps_per_rev.max, config.slot_width.min, config.slot_width.max,
+           config.edge_jitter, config.miss_rate, config.pullout_rate, config.analog ? "analog" : "digital", trials_per_cell);
+    printf("samples  rate  failed  mean err  stddev  p95 |err|  max |err|  time s\n");
+    int best_samples = 0;
+    int best_rate = 0;
+    double best_time = INFINITY;
+    trial *trials = calloc((size_t)trials_per_cell, sizeof(trial));
+    for (int s = 0; s < sample_count; s++) {
+        for (int r = 0; r < rate_count; r++) {
+            for (int i = 0; i < trials_per_cell; i++) {
+                trials[i].samples = samples[s];
+                trials[i].rate = rates[r];
+            }
+            run_trials(trials, trials_per_cell, jobs, &config);
+            double time_s;
+            bool meets;
+            printf("%7d %5d", samples[s], rates[r]);
+            report_cell(trials, trials_per_cell, spec, &time_s, &meets);
+            if (meets && time_s < best_time) {
+                best_time = time_s;
+                best_samples = samples[s];
+                best_rate = rates[r];
+            }
+        }
+    }
+    free(trials);
+    if (best_samples > 0)
+        printf("Fastest within %.2f steps (p95, no failures): calib %d %d, %.1f s\n", spec, best_samples, best_rate, best_time);
+    else
+        printf("No setting met %.2f steps (p95, no failures)\n", spec);
+    return 0;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = (*state += 0x9e3779b97f4a7c15u);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+    return x ^ (x >> 31);
+}
+
+static double draw(range r, uint64_t *state) {
+    return r.min + (r.max - r.min) * (double)(next_random(state) >> 11) / 9007199254740992.0;
+}
+
+static bool parse_range(const char *text, range *r) {
+    char *end;
+    r->min = strtod(text, &end);
+    r->max = *end == ':' ? strtod(end + 1, &end) : r->min;
+    return *end == '\0' && r->min > 0 && r->max >= r->min;
+}
+
+static int parse_list(const char *text, int list[]) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", text);
+    int count = 0;
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (count == MAX_LIST || atoi(item) <= 0)
+            return 0;
+        list[count++] = atoi(item);
+    }
+    return count;
+}
+
+static void run_trials(trial trials[], int count, int jobs, const study_config *config) {
+    // Every trial of a cell gets different mechanics, but the same ones as the same trial of other cells
+    for (int i = 0; i < count; i++) {
+        uint64_t state = config->seed * 1000003u + (uint64_t)i;
+        model_params *p = &trials[i].params;
+        model_defaults(p);
+        p->steps_per_rev = draw(config->steps_per_rev, &state);
+        p->slot_width = draw(config->slot_width, &state);
+        p->start_position = draw((range){0.0, p->steps_per_rev}, &state);
+        p->edge_jitter = config->edge_jitter;
+        p->miss_rate = config->miss_rate;
+        p->pullout_rate = config->pullout_rate;
+        p->seed = next_random(&state);
+    }
+    job running[MAX_JOBS];
+    int active = 0;
+    int next = 0;
+    while (next < count || active > 0) {
+        while (active < jobs && next < count) {
+            if (start_trial(&running[active], &trials[next], config))
+                active++;
+            next++;
+        }
+        struct pollfd fds[MAX_JOBS];
+        for (int i = 0; i < active; i++)
+            fds[i] = (struct pollfd){running[i].fd, POLLIN, 0};
+        if (poll(fds, (nfds_t)active, -1) <= 0)
+            continue;
+        for (int i = active - 1; i >= 0; i--) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP)))
+                continue;
+            job *j = &running[i];
+            char buf[1024];
+            const ssize_t n = read(j->fd, buf, sizeof(buf));
+            if (n > 0) {
+                const size_t room = OUTPUT_SIZE - 1 - j->length;
+                memcpy(j->output + j->length, buf, (size_t)n < room ? (size_t)n : room);
+                j->length += (size_t)n < room ? (size_t)n : room;
+                continue;
+            }
+            finish_trial(j);
+            running[i] = running[--active];
+        }
+    }
+}
+
+static bool start_trial(job *j, trial *t, const study_config *config) {
+    int in[2];
+    int out[2];
+    if (pipe(in) != 0 || pipe(out) != 0)
+        return false;
+    char commands[64];
+    snprintf(commands, sizeof(commands), "%scalib %d %d\r\n", config->analog ? "sensor analog\r\n" : "", t->samples, t->rate);
+    // The child must not inherit (and print again) what the parent has not flushed yet
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        // A fresh unit on the virtual clock: the commands come from the pipe, the console goes back to the parent
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        sim_clock_init(true);
+        sim_sdk_init();
+        model_init(&t->params);
+        atexit(print_time);
+        firmware_main();
+        _exit(0);
+    }
+    close(in[0]);
+    close(out[1]);
+    // Both commands fit in the pipe buffer; closing it makes the unit power off after the last one
+    if (write(in[1], commands, strlen(commands)) < 0)
+        perror("write");
+    close(in[1]);
+    j->pid = pid;
+    j->fd = out[0];
+    j->t = t;
+    j->length = 0;
+    return pid > 0;
+}
+
+static void finish_trial(job *j) {
+    close(j->fd);
+    waitpid(j->pid, NULL, 0);
+    j->output[j->length] = '\0';
+    trial *t = j->t;
+    t->completed = strstr(j->output, "Calibration completed") != NULL;
+    t->error = 0;
+    t->time_s = 0;
+    // The last statistics line is the accepted attempt
+    const char *line = NULL;
+    for (const char *p = strstr(j->output, "Median "); p != NULL; p = strstr(p + 1, "Median "))
+        line = p;
+    double median;
+    double mean;
+    if (line != NULL && sscanf(line, "Median %lf, mean %lf", &median, &mean) == 2)
+        t->error = mean - t->params.steps_per_rev;
+    const char *time_line = strstr(j->output, "Sim time ");
+    unsigned long long time_us;
+    if (time_line != NULL && sscanf(time_line, "Sim time %llu", &time_us) == 1)
+        t->time_s = (double)time_us / 1e6;
+}
+
+static void report_cell(const trial trials[], int count, double spec, double *time_s, bool *meets) {
+    double *errors = calloc((size_t)count, sizeof(double));
+    int ok = 0;
+    double sum = 0;
+    double sum_sq = 0;
+    double time_sum = 0;
+    for (int i = 0; i < count; i++) {
+        time_sum += trials[i].time_s;
+        if (!trials[i].completed)
+            continue;
+        sum += trials[i].error;
+        sum_sq += trials[i].error * trials[i].error;
+        errors[ok++] = fabs(trials[i].error);
+    }
+    qsort(errors, (size_t)ok, sizeof(double), compare_double);
+    const double mean = ok > 0 ? sum / ok : 0;
+    const double stddev = ok > 1 ? sqrt((sum_sq - sum * mean) / (ok - 1)) : 0;
+    const double p95 = ok > 0 ? errors[(int)ceil(0.95 * ok) - 1] : 0;
+    *time_s = time_sum / count;
+    *meets = ok == count && p95 <= spec;
+    printf(" %7d %9.3f %7.3f %10.3f %10.3f %7.1f\n", count - ok, mean, stddev, p95, ok > 0 ? errors[ok - 1] : 0, *time_s);
+    fflush(stdout);
+    free(errors);
+}
+
+static int compare_double(const void *a, const void *b) {
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_time(void) {
+    printf("Sim time %llu\n", (unsigned long long)sim_clock_input_end());
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    fprintf(stderr, "  --trials N            calibrations per sample count and rate (default 200)\n");
+    fprintf(stderr, "  --samples LIST        revolutions per calibration (default 1,2,3,5,8)\n");
+    fprintf(stderr, "  --rates LIST          calibration step rates in steps/s (default 100,200,333,500,800)\n");
+    fprintf(stderr, "  --sensor digital|analog  opto sensing mode (default digital)\n");
+    fprintf(stderr, "  --steps-per-rev A:B   true half-steps per revolution, uniform (default 4090:4100)\n");
+    fprintf(stderr, "  --slot-width A:B      half-steps the beam stays blocked, uniform (default 1900)\n");
+    fprintf(stderr, "  --edge-jitter N       standard deviation of each slot edge pass in half-steps (default 0.5)\n");
+    fprintf(stderr, "  --miss-rate P         probability that a step is lost at any rate (default 0)\n");
+    fprintf(stderr, "  --pullout R           step rate at which half of the steps are lost, 0 for none (default 1600)\n");
+    fprintf(stderr, "  --spec N              required accuracy: 95 %% of errors within N steps (default 1)\n");
+    fprintf(stderr, "  --jobs N              simulations run in parallel (default: one per CPU)\n");
+    fprintf(stderr, "  --seed N              seed of the randomised mechanics (default 1)\n");
+}
@@ -0,0 +1,183 @@
+#include <poll.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "pico/stdlib.h"
+#include "sim.h"
+
+#define POLL_COST_US 10 // Virtual time one input poll takes, so loops polling with no timeout still see time pass
+#define INPUT_BLOCK_AFTER_US 1000000 // Virtual input silence after which the simulator waits for real input
+#define EOF_LINGER_US 1000000 // Idle time after the end of piped input before the unit powers off
+
+static bool virtual_clock; // Time jumps from event to event instead of following the wall clock
+static uint64_t virtual_now; // Current virtual time
+static struct timespec boot_time; // Wall clock time 0
+static uint64_t last_input_us; // When the last input character was read
+static bool input_ended; // Piped input is exhausted
+static uint64_t input_end_us; // When the end of the input was read
+
+static void advance_to(uint64_t target_us); // Virtual clock: jump through the due hardware events to target_us
+static bool wait_real(uint64_t target_us, int fd); // Wall clock: run due events until target_us, true once fd is readable
+static bool input_ready(int timeout_ms); // poll() stdin, -1 waits for ever
+static int replay_getchar(uint32_t timeout_us); // Next replayed command byte once it is due
+static void input_end(void); // Power off once the end of the input has been idle for a while
+
+void sim_clock_init(bool virtual_time) {
+    virtual_clock = virtual_time;
+    virtual_now = 0;
+    clock_gettime(CLOCK_MONOTONIC, &boot_time);
+}
+
+void sim_clock_resume(uint64_t now_us) {
+    if (virtual_clock)
+        virtual_now = now_us;
+}
+
+uint64_t sim_clock_input_end(void) {
+    return input_end_us;
+}
+
+void stdio_init_all(void) {
+    // stdin/stdout are already the serial port (terminal, pipe or PTY master)
+    setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+int getchar_timeout_us(uint32_t timeout_us) {
+    if (sim_replay_active())
+        return replay_getchar(timeout_us);
+    // The host's next line comes after the STEP pulses it is sending
+    const int fd = input_ended || sim_step_input_pending() ? -1 : STDIN_FILENO;
+    bool ready;
+    if (virtual_clock) {
+        sim_hardware_service(virtual_now);
+        ready = fd >= 0 && input_ready(0);
+        // Host quiet for a while and no hardware event pending: nothing can happen until it sends more
+        if (!ready && fd >= 0 && virtual_now - last_input_us >= INPUT_BLOCK_AFTER_US &&
+            sim_hardware_next_due() == UINT64_MAX)
+            ready = input_ready(-1);
+        if (!ready)
+            advance_to(virtual_now + (timeout_us > POLL_COST_US ? timeout_us : POLL_COST_US));
+    } else {
+        ready = wait_real(time_us_64() + timeout_us, fd);
+    }
+    if (ready) {
+        unsigned char c;
+        const ssize_t n = read(STDIN_FILENO, &c, 1);
+        // A hung main loop stops feeding the watchdog: let time pass until it resets the firmware
+        if (n == 1 && c == SIM_HANG_BYTE && sim_reset_enabled()) {
+            fprintf(stderr, "sim: firmware hung\n");
+            while (true)
+                sleep_ms(100);
+        }
+        if (n == 1) {
+            last_input_us = time_us_64();
+            return c;
+        }
+        // End of piped input: let buffered work (e.g. G-code moves) finish before powering off
+        if (n == 0) {
+            input_ended = true;
+            input_end_us = time_us_64();
+        }
+    }
+    if (input_ended)
+        input_end();
+    return PICO_ERROR_TIMEOUT;
+}
+
+static int replay_getchar(uint32_t timeout_us) {
+    uint64_t due;
+    int c = sim_replay_input(time_us_64(), &due);
+    if (c == SIM_REPLAY_WAIT) {
+        const uint64_t deadline = time_us_64() + (timeout_us > POLL_COST_US ? timeout_us : POLL_COST_US);
+        sleep_until(due < deadline ? due : deadline);
+        c = sim_replay_input(time_us_64(), &due);
+    }
+    if (c >= 0)
+        return c;
+    if (c == SIM_REPLAY_END) {
+        if (!input_ended) {
+            input_ended = true;
+            input_end_us = time_us_64();
+        }
+        sleep_us(timeout_us > POLL_COST_US ? timeout_us : POLL_COST_US);
+        input_end();
+    }
+    return PICO_ERROR_TIMEOUT;
+}
+
+static void input_end(void) {
+    if (time_us_64() - input_end_us >= EOF_LINGER_US)
+        exit(0);
+}
+
+uint64_t time_us_64(void) {
+    if (virtual_clock)
+        return virtual_now;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t ns = (int64_t)(now.tv_sec - boot_time.tv_sec) * 1000000000 + (now.tv_nsec - boot_time.tv_nsec);
+    return (uint64_t)ns / 1000;
+}
+
+uint32_t time_us_32(void) {
+    return (uint32_t)time_us_64();
+}
+
+absolute_time_t get_absolute_time(void) {
+    return time_us_64();
+}
+
+void sleep_until(absolute_time_t target) {
+    if (virtual_clock)
+        advance_to(target);
+    else
+        wait_real(target, -1);
+}
+
+void sleep_us(uint64_t us) {
+    sleep_until(time_us_64() + us);
+}
+
+void sleep_ms(uint32_t ms) {
+    sleep_until(time_us_64() + (uint64_t)ms * 1000u);
+}
+
+static void advance_to(uint64_t target_us) {
+    // Interrupts only run while the firmware waits, so no handler lands in the middle of a step
+    uint64_t due;
+    while ((due = sim_hardware_next_due()) <= target_us) {
+        if (due > virtual_now)
+            virtual_now = due;
+        sim_hardware_service(virtual_now);
+    }
+    if (target_us > virtual_now)
+        virtual_now = target_us;
+    sim_hardware_service(virtual_now);
+}
+
+static bool wait_real(uint64_t target_us, int fd) {
+    while (true) {
+        const uint64_t now = time_us_64();
+        sim_hardware_service(now);
+        const uint64_t due = sim_hardware_next_due();
+        const uint64_t wake = due < target_us ? due : target_us;
+        const int64_t wait_us = wake > now ? (int64_t)(wake - now) : 0;
+        if (fd >= 0) {
+            // poll() has millisecond resolution: round up so a timeout never busy-loops
+            if (input_ready((int)((wait_us + 999) / 1000)))
+                return true;
+        } else if (wait_us > 0) {
+            const struct timespec ts = {(time_t)(wait_us / 1000000), (long)(wait_us % 1000000) * 1000};
+            nanosleep(&ts, NULL);
+        }
+        if (time_us_64() >= target_us) {
+            sim_hardware_service(time_us_64());
+            return false;
+        }
+    }
+}
+
+static bool input_ready(int timeout_ms) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, timeout_ms) > 0;
+}
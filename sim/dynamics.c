@@ -0,0 +1,82 @@
+#include <math.h>
+#include <string.h>
+#include "dynamics.h"
+
+#define PHASES_PER_CYCLE 8 // Half-steps in one electrical cycle
+#define SETTLED_ERROR 0.5 // Rotor error (half-steps) that counts as on target
+
+static const char *mode_names[] = {"wave", "full", "half"};
+
+void dynamics_defaults(motor_dynamics *m) {
+    m->torque_accel = 60000.0;
+    m->corner_rate = 400.0;
+    m->damping = 10.0;
+    m->friction = 12000.0;
+    m->coil_power = 0.5;
+    m->settle_time = 0.3;
+    m->dt = 50e-6;
+}
+
+const char *drive_mode_name(drive_mode mode) {
+    return mode_names[mode];
+}
+
+bool drive_mode_parse(const char *name, drive_mode *mode) {
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(name, mode_names[i]) == 0) {
+            *mode = (drive_mode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+move_result dynamics_run(const motor_dynamics *m, drive_mode mode, double current, const double step_times[], int steps) {
+    // Wave drive sits on the single-coil detents (even half-steps), full step on the two-coil ones (odd)
+    const int advance = mode == DRIVE_HALF ? 1 : 2;
+    int command = mode == DRIVE_FULL ? 1 : 0;
+    const int target = command + steps / advance * advance;
+    double angle = command;
+    double speed = 0.0;
+    double energy = 0.0;
+    double last_off_target = 0.0;
+    int next_step = advance - 1; // Index in step_times of the next phase change
+    const double end = (steps > 0 ? step_times[steps - 1] : 0.0) + m->settle_time;
+
+    for (double t = 0.0; t < end; t += m->dt) {
+        // Phase changes that are due; wave and full step take every second half-step time
+        while (next_step < steps && step_times[next_step] <= t) {
+            command += advance;
+            next_step += advance;
+        }
+        // Odd half-step positions have two coils on, for sqrt(2) the torque of one
+        const int coils = (command & 1) ? 2 : 1;
+        // The coil current falls with speed as the back-EMF and inductance catch up with the supply
+        const double rate = fabs(speed) / m->corner_rate;
+        const double falloff = 1.0 / sqrt(1.0 + rate * rate);
+        const double drive = current * (coils == 2 ? M_SQRT2 : 1.0) * falloff;
+        const double torque = m->torque_accel * drive * sin(2.0 * M_PI * (command - angle) / PHASES_PER_CYCLE);
+        double accel = torque - m->damping * speed;
+        // Static friction holds the rotor until the torque overcomes it
+        if (speed != 0.0)
+            accel -= copysign(m->friction, speed);
+        else if (fabs(accel) <= m->friction)
+            accel = 0.0;
+        else
+            accel -= copysign(m->friction, accel);
+        const double new_speed = speed + accel * m->dt;
+        // Friction stops the rotor instead of reversing it
+        speed = speed != 0.0 && (new_speed > 0.0) != (speed > 0.0) ? 0.0 : new_speed;
+        angle += speed * m->dt;
+        // PWM duty scales the average coil power; the falling current at speed reduces it further
+        energy += coils * m->coil_power * current * falloff * falloff * m->dt;
+        if (fabs(angle - command) > SETTLED_ERROR)
+            last_off_target = t;
+    }
+
+    move_result result;
+    result.time_s = fmax(last_off_target, steps > 0 ? step_times[steps - 1] : 0.0);
+    result.missed = (int)lround(fabs(target - angle));
+    result.energy_j = energy;
+    return result;
+}
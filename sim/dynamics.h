@@ -0,0 +1,37 @@
+#ifndef SIM_DYNAMICS_H
+#define SIM_DYNAMICS_H
+
+#include <stdbool.h>
+
+// Coil sequences of stepper.hpp: wave and full step advance two half-steps per phase change
+typedef enum {
+    DRIVE_WAVE, // One coil at a time
+    DRIVE_FULL, // Two coils at a time
+    DRIVE_HALF // One and two coils alternately
+} drive_mode;
+
+// Rotor and gear train of the motor, in half-steps at the motor position counter
+typedef struct {
+    double torque_accel; // Peak acceleration one fully driven coil gives the rotor and gear train (half-steps/s^2)
+    double corner_rate; // Speed at which inductance has cut the coil current to 1/sqrt(2) (half-steps/s)
+    double damping; // Viscous damping (1/s)
+    double friction; // Coulomb friction of the gear train (half-steps/s^2)
+    double coil_power; // Power of one coil at full drive (W)
+    double settle_time; // Time simulated after the last step (s)
+    double dt; // Integration step (s)
+} motor_dynamics;
+
+// Outcome of one simulated move
+typedef struct {
+    double time_s; // Until the rotor stays within half a step of the target
+    int missed; // Half-steps between the commanded and the final rotor position
+    double energy_j; // Energy dissipated in the coils
+} move_result;
+
+void dynamics_defaults(motor_dynamics *m); // Parameters of the 28BYJ-48 on a ULN2003 at 5 V
+const char *drive_mode_name(drive_mode mode); // "wave", "full" or "half"
+bool drive_mode_parse(const char *name, drive_mode *mode); // Inverse of drive_mode_name
+// Drive a move whose half-step i (1..steps) is due at step_times[i - 1] seconds; current is the PWM duty (0..1]
+move_result dynamics_run(const motor_dynamics *m, drive_mode mode, double current, const double step_times[], int steps);
+
+#endif
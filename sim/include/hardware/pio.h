@@ -0,0 +1,60 @@
+// Host stand-in for hardware/pio.h. Programs are not executed: sim/pio.c models what each of the
+// firmware's programs reports, identified by the name the generated header puts in pio_program_t.
+#ifndef SIM_HARDWARE_PIO_H
+#define SIM_HARDWARE_PIO_H
+
+#include "pico/stdlib.h"
+
+typedef struct pio_hw pio_hw_t;
+typedef pio_hw_t *PIO;
+
+extern pio_hw_t sim_pio0_hw, sim_pio1_hw;
+#define pio0 (&sim_pio0_hw)
+#define pio1 (&sim_pio1_hw)
+
+#define PIO_FIFO_JOIN_RX 2
+
+enum pio_interrupt_source { pis_sm0_rx_fifo_not_empty = 0 };
+
+typedef struct {
+    const char *name; // Program name, "opto_filter" for opto_filter.pio
+} pio_program_t;
+
+typedef struct {
+    uint in_base; // First input pin
+    uint jmp_pin; // Pin tested by JMP PIN
+} pio_sm_config;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint pio_add_program(PIO pio, const pio_program_t *program);
+int pio_claim_unused_sm(PIO pio, bool required);
+void pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config *config);
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled);
+void pio_sm_clear_fifos(PIO pio, uint sm);
+bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm);
+uint32_t pio_sm_get(PIO pio, uint sm);
+void pio_sm_put(PIO pio, uint sm, uint32_t data);
+void pio_set_irq0_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled);
+void pio_set_irq1_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled);
+
+static inline pio_sm_config sim_pio_default_config(uint offset) {
+    (void)offset;
+    pio_sm_config c = {0, 0};
+    return c;
+}
+static inline void sm_config_set_in_pins(pio_sm_config *c, uint in_base) { c->in_base = in_base; }
+static inline void sm_config_set_jmp_pin(pio_sm_config *c, uint pin) { c->jmp_pin = pin; }
+static inline void sm_config_set_clkdiv(pio_sm_config *c, float div) { (void)c; (void)div; }
+static inline void sm_config_set_in_shift(pio_sm_config *c, bool shift_right, bool autopush, uint push_threshold) {
+    (void)c; (void)shift_right; (void)autopush; (void)push_threshold;
+}
+static inline void sm_config_set_fifo_join(pio_sm_config *c, int join) { (void)c; (void)join; }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
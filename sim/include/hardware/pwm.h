@@ -0,0 +1,7 @@
+// Host stand-in for hardware/pwm.h: the firmware includes it but drives no PWM slices
+#ifndef SIM_HARDWARE_PWM_H
+#define SIM_HARDWARE_PWM_H
+
+#include "pico/stdlib.h"
+
+#endif
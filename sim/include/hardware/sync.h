@@ -0,0 +1,10 @@
+// Host stand-in for hardware/sync.h: simulated interrupts only run while the firmware sleeps or polls input
+#ifndef SIM_HARDWARE_SYNC_H
+#define SIM_HARDWARE_SYNC_H
+
+#include "pico/stdlib.h"
+
+static inline uint32_t save_and_disable_interrupts(void) { return 0; }
+static inline void restore_interrupts(uint32_t status) { (void)status; }
+
+#endif
@@ -0,0 +1,28 @@
+// Host stand-in for hardware/watchdog.h: a missed deadline resets the firmware (sim/reset.c) or is reported
+#ifndef SIM_HARDWARE_WATCHDOG_H
+#define SIM_HARDWARE_WATCHDOG_H
+
+#include "pico/stdlib.h"
+
+typedef struct {
+    volatile uint32_t ctrl;
+    volatile uint32_t load;
+    volatile uint32_t reason;
+    volatile uint32_t scratch[8];
+} watchdog_hw_t;
+
+extern watchdog_hw_t *watchdog_hw;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug);
+void watchdog_update(void);
+bool watchdog_caused_reboot(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
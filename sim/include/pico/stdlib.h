@@ -0,0 +1,54 @@
+// Host stand-in for the Pico SDK: the subset of pico/stdlib.h the firmware uses, implemented in sim/sdk.c
+#ifndef SIM_PICO_STDLIB_H
+#define SIM_PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t; // Microseconds since the simulated boot
+
+// Reset-proof RAM gets a section of its own, which sim/reset.c carries over a watchdog reset
+#define __uninitialized_ram(group) __attribute__((section("sim_uninitialized_ram"))) group
+
+#define GPIO_OUT 1
+#define GPIO_IN 0
+#define PICO_ERROR_TIMEOUT (-1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void stdio_init_all(void);
+int getchar_timeout_us(uint32_t timeout_us);
+
+void gpio_init(uint gpio);
+void gpio_init_mask(uint32_t mask);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_set_dir_out_masked(uint32_t mask);
+void gpio_pull_up(uint gpio);
+void gpio_put(uint gpio, bool value);
+void gpio_put_masked(uint32_t mask, uint32_t value);
+void gpio_clr_mask(uint32_t mask);
+bool gpio_get(uint gpio);
+
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+absolute_time_t get_absolute_time(void);
+void sleep_until(absolute_time_t target);
+void sleep_us(uint64_t us);
+void sleep_ms(uint32_t ms);
+
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t)(t / 1000); }
+static inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) { return t + us; }
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return (int64_t)(to - from); }
+static inline void tight_loop_contents(void) {}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
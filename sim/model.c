@@ -0,0 +1,158 @@
+#include <math.h>
+#include "model.h"
+
+// Coil patterns in rotation order: wave and full-step patterns are every other entry
+static const uint32_t half_step_patterns[8] = {0x1, 0x3, 0x2, 0x6, 0x4, 0xc, 0x8, 0x9};
+
+#define PULLOUT_EXPONENT 8 // How steeply the lost-step probability rises towards the pull-out rate
+
+static model_params model;
+static long rotor; // Motor position (half-steps)
+static int rotor_phase = -1; // Index of the energized pattern, -1 before the first one
+static uint64_t last_step_us; // Time of the previous phase change
+static double output; // Output shaft position (half-steps)
+
+static uint64_t random_state; // Missed step generator
+
+static uint64_t mix(uint64_t x); // splitmix64 finalizer
+static double uniform(uint64_t x); // Uniform in (0, 1) from a hashed value
+static double edge_offset(long pass, int edge); // Jitter of one edge of one pass of the slot
+
+void model_defaults(model_params *params) {
+    params->steps_per_rev = 4096.3;
+    params->backlash = 12.0;
+    params->slot_start = 100.0;
+    params->slot_width = 1900.0;
+    params->edge_width = 10.0;
+    params->start_position = 0.0;
+    params->encoder_counts = 0;
+    params->edge_jitter = 0.0;
+    params->miss_rate = 0.0;
+    params->pullout_rate = 0.0;
+    params->seed = 1;
+}
+
+void model_init(const model_params *params) {
+    model = *params;
+    output = params->start_position;
+    rotor = lround(output);
+    rotor_phase = -1;
+    last_step_us = 0;
+    random_state = params->seed;
+}
+
+bool model_coils(uint32_t pattern, uint64_t now_us) {
+    const int phase = model_pattern_phase(pattern);
+    // Released coils or a pattern between phases leave the rotor where it is
+    if (phase < 0)
+        return false;
+    // The first pattern after power-up pulls the rotor into the nearest matching detent
+    if (rotor_phase < 0) {
+        rotor_phase = phase;
+        last_step_us = now_us;
+        return false;
+    }
+    int delta = (phase - rotor_phase) & 7;
+    if (delta > 4)
+        delta -= 8;
+    rotor_phase = phase;
+    // Opposite pattern: the rotor cannot tell which way to turn and stays put
+    if (delta == 0 || delta == 4 || delta == -4)
+        return false;
+    // Torque falls with speed: the faster the phases change, the likelier the rotor cannot keep up
+    double miss = model.miss_rate;
+    if (model.pullout_rate > 0 && now_us > last_step_us) {
+        const double rate = 1e6 / (double)(now_us - last_step_us);
+        miss += 0.5 * pow(rate / model.pullout_rate, PULLOUT_EXPONENT);
+    }
+    last_step_us = now_us;
+    // A missed step: the rotor slips back into the detent it came from and the step is lost
+    random_state += 0x9e3779b97f4a7c15u;
+    if (miss > 0 && uniform(random_state) < miss)
+        return false;
+    rotor += delta;
+    // The output only follows once the play on the driving side has been taken up
+    const double play = model.backlash / 2.0;
+    if ((double)rotor > output + play)
+        output = (double)rotor - play;
+    else if ((double)rotor < output - play)
+        output = (double)rotor + play;
+    return true;
+}
+
+double model_output(void) {
+    return output;
+}
+
+uint16_t model_sensor_adc(void) {
+    // Number the passes of the slot so that each one, with the clear part around it, gets its own jitter
+    const double margin = (model.steps_per_rev - model.slot_width) / 2.0;
+    const long pass = (long)floor((output - model.slot_start + margin) / model.steps_per_rev);
+    const double x = output - model.slot_start - (double)pass * model.steps_per_rev;
+    const double start = edge_offset(pass, 0);
+    const double end = model.slot_width + edge_offset(pass, 1);
+    // Linear ramp over edge_width at both ends of the slot
+    double covered = 0.0;
+    if (x >= start && x < end) {
+        covered = 1.0;
+        if (model.edge_width > 0 && x - start < model.edge_width)
+            covered = (x - start) / model.edge_width;
+        else if (model.edge_width > 0 && end - x < model.edge_width)
+            covered = (end - x) / model.edge_width;
+    }
+    return (uint16_t)lround(MODEL_ADC_CLEAR - covered * (MODEL_ADC_CLEAR - MODEL_ADC_BLOCKED));
+}
+
+bool model_sensor(void) {
+    return model_sensor_adc() >= (MODEL_ADC_CLEAR + MODEL_ADC_BLOCKED) / 2;
+}
+
+long model_encoder_count(void) {
+    if (model.encoder_counts <= 0)
+        return 0;
+    return (long)floor(output * model.encoder_counts / model.steps_per_rev);
+}
+
+void model_save(model_state *state) {
+    state->rotor = rotor;
+    state->rotor_phase = rotor_phase;
+    state->last_step_us = last_step_us;
+    state->output = output;
+    state->random_state = random_state;
+}
+
+void model_restore(const model_state *state) {
+    rotor = state->rotor;
+    rotor_phase = state->rotor_phase;
+    last_step_us = state->last_step_us;
+    output = state->output;
+    random_state = state->random_state;
+}
+
+int model_pattern_phase(uint32_t pattern) {
+    for (int i = 0; i < 8; i++) {
+        if (half_step_patterns[i] == pattern)
+            return i;
+    }
+    return -1;
+}
+
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9u;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebu;
+    return x ^ (x >> 31);
+}
+
+static double uniform(uint64_t x) {
+    return ((double)(mix(x) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double edge_offset(long pass, int edge) {
+    if (model.edge_jitter <= 0)
+        return 0.0;
+    // Box-Muller from two values hashed from the seed, pass and edge: the same pass always jitters the same way
+    const uint64_t key = model.seed * 0x9e3779b97f4a7c15u + (uint64_t)pass * 4 + (uint64_t)edge * 2;
+    const double u1 = uniform(key);
+    const double u2 = uniform(key + 1);
+    return model.edge_jitter * sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
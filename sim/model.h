@@ -0,0 +1,45 @@
+#ifndef SIM_MODEL_H
+#define SIM_MODEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Simulated mechanics: motor, gearbox with play, slotted disc in the opto fork, encoder on the output shaft
+typedef struct {
+    double steps_per_rev; // Motor half-steps per output revolution (the gear ratio is not a whole number)
+    double backlash; // Gear play between the motor and the output shaft (half-steps)
+    double slot_start; // Output position where the slot starts to cover the beam (half-steps)
+    double slot_width; // Output travel during which the beam stays blocked (half-steps)
+    double edge_width; // Output travel over which the analog level moves between clear and blocked (half-steps)
+    double start_position; // Output position at power-up (half-steps)
+    int encoder_counts; // Quadrature counts per output revolution, 0 for no encoder
+    double edge_jitter; // Standard deviation of where each pass of a slot edge is seen (half-steps)
+    double miss_rate; // Probability that a step leaves the rotor where it is
+    double pullout_rate; // Step rate at which half of the steps are lost, rising steeply towards it; 0 = no limit
+    uint64_t seed; // Seed of the edge jitter and the missed steps
+} model_params;
+
+// Where the mechanics are; a reset of the firmware leaves it as it is
+typedef struct {
+    long rotor;
+    int rotor_phase;
+    uint64_t last_step_us;
+    double output;
+    uint64_t random_state;
+} model_state;
+
+#define MODEL_ADC_CLEAR 4000 // ADC reading with the beam clear (pulled up)
+#define MODEL_ADC_BLOCKED 200 // ADC reading with the beam blocked
+
+void model_defaults(model_params *params); // Parameters of the reference unit
+void model_init(const model_params *params); // Power up with the output at params->start_position
+bool model_coils(uint32_t pattern, uint64_t now_us); // New coil pattern (IN1 in bit 0 .. IN4 in bit 3) at a time, true if the rotor moved
+double model_output(void); // Output shaft position (half-steps, not wrapped)
+uint16_t model_sensor_adc(void); // Opto level as a 12-bit ADC reading
+bool model_sensor(void); // Digital opto input: HIGH while the beam is clear
+long model_encoder_count(void); // Encoder count since power-up position 0
+int model_pattern_phase(uint32_t pattern); // Index in the half-step sequence, -1 for off or an invalid pattern
+void model_save(model_state *state); // Copy out the mechanical state
+void model_restore(const model_state *state); // Continue from a saved mechanical state
+
+#endif
@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "hardware/irq.h"
+#include "model.h"
+#include "sim.h"
+
+#define PIO_PROGRAMS 8 // Programs loaded into one block
+#define PIO_SMS 4 // State machines per block
+#define FIFO_DEPTH 8 // Joined RX FIFO
+#define STEP_IN_BURSTS 64 // Largest number of bursts in --step-in
+#define STEP_IN_PERIOD_US 2000 // Interval of the STEP pulses (500 Hz, within the follower's step rate)
+#define STEP_IN_SETTLE_US 100000 // Time after the last pulse for the follower to catch up
+
+// What a loaded program does, recognised from its name
+typedef enum {
+    PROGRAM_UNKNOWN,
+    PROGRAM_OPTO_FILTER, // Reports the opto level once it has been stable for the loaded count
+    PROGRAM_STEP_FOLLOWER, // Reports STEP pulses, driven by the --step-in bursts
+    PROGRAM_QUADRATURE // Reports every encoder state change
+} program_kind;
+
+typedef struct {
+    bool claimed;
+    bool enabled;
+    program_kind kind;
+    uint in_base; // First input pin
+    uint32_t fifo[FIFO_DEPTH];
+    uint fifo_head; // Oldest word
+    uint fifo_count;
+    uint64_t stable_us; // Opto filter: time the level must hold, 0 until the count is loaded
+    bool reported; // Opto filter: last reported level
+    bool level; // Opto filter: current input level
+    uint64_t level_since_us; // Opto filter: when the input took its current level
+    long encoder_count; // Quadrature: count whose state was last reported
+} sim_sm;
+
+struct pio_hw {
+    const pio_program_t *programs[PIO_PROGRAMS];
+    uint program_count;
+    sim_sm sm[PIO_SMS];
+    uint32_t irq_sources[2]; // Enabled RX-not-empty sources of IRQ 0 and IRQ 1, one bit per state machine
+};
+
+pio_hw_t sim_pio0_hw, sim_pio1_hw;
+static pio_hw_t *const blocks[2] = {&sim_pio0_hw, &sim_pio1_hw};
+static irq_handler_t irq_handlers[SIM_IRQ_COUNT];
+static bool irq_enabled[SIM_IRQ_COUNT];
+static int step_bursts[STEP_IN_BURSTS]; // Signed pulse counts, negative with DIR low
+static int step_burst_count;
+static int step_burst_next; // Burst being sent
+static int step_burst_sent; // Pulses of it sent so far
+static uint64_t step_due_us = UINT64_MAX; // When the next pulse is sent, UINT64_MAX before the follower starts
+
+static void fifo_push(sim_sm *sm, uint32_t word); // Push unless full, like "push noblock"
+static void raise_irqs(void); // Run the handlers of enabled interrupts with a pending source
+static program_kind kind_of(const pio_program_t *program); // Recognise a program by name
+
+uint pio_add_program(PIO pio, const pio_program_t *program) {
+    pio->programs[pio->program_count] = program;
+    return pio->program_count++;
+}
+
+int pio_claim_unused_sm(PIO pio, bool required) {
+    (void)required;
+    for (int i = 0; i < PIO_SMS; i++) {
+        if (!pio->sm[i].claimed) {
+            pio->sm[i].claimed = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config *config) {
+    sim_sm *s = &pio->sm[sm];
+    s->enabled = false;
+    s->kind = kind_of(pio->programs[initial_pc]);
+    s->in_base = config->in_base;
+    s->fifo_count = 0;
+    s->stable_us = 0;
+}
+
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled) {
+    sim_sm *s = &pio->sm[sm];
+    if (enabled && !s->enabled) {
+        // Both input programs start from the current input level
+        s->level = sim_gpio_input(s->in_base);
+        s->reported = s->level;
+        s->level_since_us = time_us_64();
+        s->encoder_count = model_encoder_count();
+        if (s->kind == PROGRAM_QUADRATURE)
+            fifo_push(s, (uint32_t)sim_gpio_input(s->in_base) | (uint32_t)sim_gpio_input(s->in_base + 1) << 1);
+        if (s->kind == PROGRAM_STEP_FOLLOWER && step_burst_next < step_burst_count && step_due_us == UINT64_MAX)
+            step_due_us = time_us_64() + STEP_IN_PERIOD_US;
+    }
+    s->enabled = enabled;
+}
+
+void pio_sm_clear_fifos(PIO pio, uint sm) {
+    pio->sm[sm].fifo_count = 0;
+}
+
+bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm) {
+    return pio->sm[sm].fifo_count == 0;
+}
+
+uint32_t pio_sm_get(PIO pio, uint sm) {
+    sim_sm *s = &pio->sm[sm];
+    if (s->fifo_count == 0)
+        return 0;
+    const uint32_t word = s->fifo[s->fifo_head];
+    s->fifo_head = (s->fifo_head + 1) % FIFO_DEPTH;
+    s->fifo_count--;
+    return word;
+}
+
+void pio_sm_put(PIO pio, uint sm, uint32_t data) {
+    sim_sm *s = &pio->sm[sm];
+    // The opto filter pulls its loop count: two PIO cycles at 1 us per iteration
+    if (s->kind == PROGRAM_OPTO_FILTER)
+        s->stable_us = ((uint64_t)data + 1) * 2;
+}
+
+void pio_set_irq0_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled) {
+    const uint32_t bit = 1u << (source - pis_sm0_rx_fifo_not_empty);
+    pio->irq_sources[0] = enabled ? pio->irq_sources[0] | bit : pio->irq_sources[0] & ~bit;
+}
+
+void pio_set_irq1_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled) {
+    const uint32_t bit = 1u << (source - pis_sm0_rx_fifo_not_empty);
+    pio->irq_sources[1] = enabled ? pio->irq_sources[1] | bit : pio->irq_sources[1] & ~bit;
+}
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+    irq_handlers[num] = handler;
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+    irq_enabled[num] = enabled;
+}
+
+void sim_pio_inputs_changed(uint64_t now_us) {
+    static const uint32_t gray[4] = {0, 1, 3, 2};
+    for (uint b = 0; b < 2; b++) {
+        for (uint i = 0; i < PIO_SMS; i++) {
+            sim_sm *s = &blocks[b]->sm[i];
+            if (!s->enabled)
+                continue;
+            if (s->kind == PROGRAM_OPTO_FILTER && !sim_replay_active()) {
+                const bool level = sim_gpio_input(s->in_base);
+                if (level != s->level) {
+                    s->level = level;
+                    s->level_since_us = now_us;
+                }
+            } else if (s->kind == PROGRAM_QUADRATURE) {
+                // The state machine samples far faster than the shaft turns: it sees every state on the way
+                const long target = model_encoder_count();
+                while (s->encoder_count != target) {
+                    s->encoder_count += target > s->encoder_count ? 1 : -1;
+                    fifo_push(s, gray[s->encoder_count & 3]);
+                    raise_irqs();
+                }
+            }
+        }
+    }
+}
+
+void sim_pio_service(uint64_t now_us) {
+    // Replayed edges were already filtered on the unit: report them as they were recorded
+    while (sim_replay_edge_due() <= now_us) {
+        const bool level = sim_replay_take_edge();
+        for (uint b = 0; b < 2; b++) {
+            for (uint i = 0; i < PIO_SMS; i++) {
+                sim_sm *s = &blocks[b]->sm[i];
+                if (s->enabled && s->kind == PROGRAM_OPTO_FILTER) {
+                    s->level = s->reported = level;
+                    fifo_push(s, level ? 0xffffffffu : 0);
+                }
+            }
+        }
+        raise_irqs();
+    }
+    // One STEP pulse with DIR from the sign of the burst; the words wait in the FIFO like on the board
+    while (step_due_us <= now_us) {
+        if (step_burst_next == step_burst_count) {
+            step_due_us = UINT64_MAX;
+            break;
+        }
+        const int burst = step_bursts[step_burst_next];
+        for (uint b = 0; b < 2; b++) {
+            for (uint i = 0; i < PIO_SMS; i++) {
+                sim_sm *s = &blocks[b]->sm[i];
+                if (s->enabled && s->kind == PROGRAM_STEP_FOLLOWER)
+                    fifo_push(s, burst > 0 ? 3u : 1u);
+            }
+        }
+        if (++step_burst_sent == abs(burst)) {
+            step_burst_next++;
+            step_burst_sent = 0;
+        }
+        step_due_us += step_burst_next < step_burst_count ? STEP_IN_PERIOD_US : STEP_IN_SETTLE_US;
+        raise_irqs();
+    }
+    for (uint b = 0; b < 2; b++) {
+        for (uint i = 0; i < PIO_SMS; i++) {
+            sim_sm *s = &blocks[b]->sm[i];
+            // A level that flipped back before the stable time never differs from the reported one
+            if (s->enabled && s->kind == PROGRAM_OPTO_FILTER && s->stable_us > 0 && s->level != s->reported &&
+                now_us >= s->level_since_us + s->stable_us) {
+                s->reported = s->level;
+                fifo_push(s, s->level ? 0xffffffffu : 0);
+            }
+        }
+    }
+    raise_irqs();
+}
+
+uint64_t sim_pio_next_due(void) {
+    uint64_t due = sim_replay_edge_due() < step_due_us ? sim_replay_edge_due() : step_due_us;
+    for (uint b = 0; b < 2; b++) {
+        for (uint i = 0; i < PIO_SMS; i++) {
+            const sim_sm *s = &blocks[b]->sm[i];
+            if (s->enabled && s->kind == PROGRAM_OPTO_FILTER && s->stable_us > 0 && s->level != s->reported &&
+                s->level_since_us + s->stable_us < due)
+                due = s->level_since_us + s->stable_us;
+        }
+    }
+    return due;
+}
+
+bool sim_step_input_open(const char *spec) {
+    // Comma-separated non-zero pulse counts, e.g. "30,-4,4"
+    step_burst_count = 0;
+    for (const char *p = spec; *p != '\0'; p++) {
+        char *end;
+        const long pulses = strtol(p, &end, 10);
+        if (end == p || pulses == 0 || labs(pulses) > 1000000 || step_burst_count == STEP_IN_BURSTS ||
+            (*end != ',' && *end != '\0'))
+            return false;
+        step_bursts[step_burst_count++] = (int)pulses;
+        p = end;
+        if (*p == '\0')
+            break;
+    }
+    return step_burst_count > 0;
+}
+
+bool sim_step_input_pending(void) {
+    return step_due_us != UINT64_MAX;
+}
+
+static void fifo_push(sim_sm *sm, uint32_t word) {
+    if (sm->fifo_count == FIFO_DEPTH)
+        return;
+    sm->fifo[(sm->fifo_head + sm->fifo_count) % FIFO_DEPTH] = word;
+    sm->fifo_count++;
+}
+
+static void raise_irqs(void) {
+    for (uint b = 0; b < 2; b++) {
+        pio_hw_t *pio = blocks[b];
+        for (uint line = 0; line < 2; line++) {
+            const uint num = PIO0_IRQ_0 + b * 2 + line;
+            if (!irq_enabled[num] || irq_handlers[num] == NULL)
+                continue;
+            for (uint i = 0; i < PIO_SMS; i++) {
+                if ((pio->irq_sources[line] >> i & 1u) && pio->sm[i].fifo_count > 0) {
+                    irq_handlers[num]();
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static program_kind kind_of(const pio_program_t *program) {
+    if (strcmp(program->name, "opto_filter") == 0)
+        return PROGRAM_OPTO_FILTER;
+    if (strcmp(program->name, "step_follower") == 0)
+        return PROGRAM_STEP_FOLLOWER;
+    if (strcmp(program->name, "quadrature") == 0)
+        return PROGRAM_QUADRATURE;
+    return PROGRAM_UNKNOWN;
+}
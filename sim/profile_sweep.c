@@ -0,0 +1,295 @@
+// Parameter sweep over motion profiles: drives one move through the rotor dynamics model for every
+// combination of top speed, acceleration, jerk, drive mode and coil current, on a pool of threads,
+// and reports move time, missed steps and coil energy with the Pareto front of the three. A stalled
+// rotor finishes its profile as early as one that keeps up, so points that lose more than --max-missed
+// steps are kept out of the front.
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dynamics.h"
+#include "ramp_table.h"
+
+#define MAX_LIST 16 // Entries per grid axis
+#define MAX_THREADS 256 // Largest --threads
+#define PROFILE_DT 10e-6 // Sampling interval of the position profile (s)
+
+// One grid point and its outcome
+typedef struct {
+    double speed; // Top speed (half-steps/s)
+    double accel; // Acceleration and deceleration (half-steps/s^2)
+    double jerk; // Rate of change of acceleration (half-steps/s^3), 0 = unlimited as in the firmware
+    drive_mode mode;
+    double current; // PWM duty of the coils
+    move_result result;
+    bool pareto; // Not dominated by any other point
+} sweep_point;
+
+// Work shared by the pool
+typedef struct {
+    sweep_point *points;
+    int count;
+    atomic_int next; // Next point to evaluate
+    int steps; // Length of the move
+    motor_dynamics motor;
+} sweep;
+
+static double trapezoid_position(double t, double distance, double speed, double accel); // Firmware ramp, at time t
+static int build_profile(const sweep_point *p, int steps, double step_times[]); // Step times of the move
+static void *worker(void *arg); // Evaluate points until none are left
+static void mark_pareto(sweep_point points[], int count, int max_missed); // Flag the non-dominated points
+static bool dominates(const move_result *a, const move_result *b); // a is no worse in all and better in one
+static int compare_time(const void *a, const void *b); // qsort order of the front
+static int parse_list(const char *text, double list[]); // "1,2,3", number of entries or 0
+static int parse_modes(const char *text, drive_mode list[]); // "wave,full,half", number of entries or 0
+static void print_point(const sweep_point *p); // One table row
+static void usage(const char *name); // Print the options
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"steps", required_argument, NULL, 'n'},
+        {"speeds", required_argument, NULL, 's'},
+        {"accels", required_argument, NULL, 'a'},
+        {"jerks", required_argument, NULL, 'j'},
+        {"modes", required_argument, NULL, 'm'},
+        {"currents", required_argument, NULL, 'c'},
+        {"torque", required_argument, NULL, 'T'},
+        {"corner", required_argument, NULL, 'C'},
+        {"friction", required_argument, NULL, 'F'},
+        {"damping", required_argument, NULL, 'D'},
+        {"max-missed", required_argument, NULL, 'x'},
+        {"threads", required_argument, NULL, 'p'},
+        {"all", no_argument, NULL, 'A'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    sweep s;
+    dynamics_defaults(&s.motor);
+    s.steps = 4096;
+    double speeds[MAX_LIST] = {400, 600, MAX_STEP_RATE, 1000, 1200};
+    int speed_count = 5;
+    double accels[MAX_LIST] = {1000, MAX_ACCEL, 4000, 8000};
+    int accel_count = 4;
+    double jerks[MAX_LIST] = {0, 20000, 50000};
+    int jerk_count = 3;
+    drive_mode modes[MAX_LIST] = {DRIVE_WAVE, DRIVE_FULL, DRIVE_HALF};
+    int mode_count = 3;
+    double currents[MAX_LIST] = {0.5, 0.75, 1.0};
+    int current_count = 3;
+    int max_missed = 0;
+    bool print_all = false;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (int)cpus : 1;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 'n': s.steps = atoi(optarg); ok = s.steps > 0; break;
+            case 's': speed_count = parse_list(optarg, speeds); ok = speed_count > 0; break;
+            case 'a': accel_count = parse_list(optarg, accels); ok = accel_count > 0; break;
+            case 'j': jerk_count = parse_list(optarg, jerks); ok = jerk_count > 0; break;
+            case 'm': mode_count = parse_modes(optarg, modes); ok = mode_count > 0; break;
+            case 'c': current_count = parse_list(optarg, currents); ok = current_count > 0; break;
+            case 'T': s.motor.torque_accel = atof(optarg); break;
+            case 'C': s.motor.corner_rate = atof(optarg); break;
+            case 'F': s.motor.friction = atof(optarg); break;
+            case 'D': s.motor.damping = atof(optarg); break;
+            case 'x': max_missed = atoi(optarg); ok = max_missed >= 0; break;
+            case 'p': threads = atoi(optarg); ok = threads > 0; break;
+            case 'A': print_all = true; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    bool valid = true;
+    for (int i = 0; i < speed_count; i++)
+        valid = valid && speeds[i] > 0;
+    for (int i = 0; i < accel_count; i++)
+        valid = valid && accels[i] > 0;
+    for (int i = 0; i < jerk_count; i++)
+        valid = valid && jerks[i] >= 0;
+    for (int i = 0; i < current_count; i++)
+        valid = valid && currents[i] > 0 && currents[i] <= 1;
+    if (!valid) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    s.count = speed_count * accel_count * jerk_count * mode_count * current_count;
+    s.points = calloc((size_t)s.count, sizeof(sweep_point));
+    int n = 0;
+    for (int a = 0; a < speed_count; a++)
+        for (int b = 0; b < accel_count; b++)
+            for (int c = 0; c < jerk_count; c++)
+                for (int d = 0; d < mode_count; d++)
+                    for (int e = 0; e < current_count; e++)
+                        s.points[n++] = (sweep_point){
+                            .speed = speeds[a], .accel = accels[b], .jerk = jerks[c], .mode = modes[d], .current = currents[e]};
+    atomic_init(&s.next, 0);
+
+    pthread_t pool[MAX_THREADS];
+    for (int i = 0; i < threads; i++)
+        pthread_create(&pool[i], NULL, worker, &s);
+    for (int i = 0; i < threads; i++)
+        pthread_join(pool[i], NULL);
+    mark_pareto(s.points, s.count, max_missed);
+
+    printf("Move of %d half-steps, %d points on %d threads\n", s.steps, s.count, threads);
+    printf(" speed  accel   jerk  mode  current  time s  missed  energy J\n");
+    if (print_all) {
+        for (int i = 0; i < s.count; i++)
+            print_point(&s.points[i]);
+        printf("Pareto front:\n");
+    }
+    qsort(s.points, (size_t)s.count, sizeof(sweep_point), compare_time);
+    for (int i = 0; i < s.count; i++) {
+        if (s.points[i].pareto)
+            print_point(&s.points[i]);
+    }
+    free(s.points);
+    return 0;
+}
+
+static double trapezoid_position(double t, double distance, double speed, double accel) {
+    // Triangular when the move is too short to reach the top speed
+    if (speed * speed / accel > distance)
+        speed = sqrt(distance * accel);
+    const double ramp = speed / accel;
+    const double cruise = (distance - speed * ramp) / speed;
+    if (t <= 0)
+        return 0;
+    if (t < ramp)
+        return 0.5 * accel * t * t;
+    if (t < ramp + cruise)
+        return 0.5 * speed * ramp + speed * (t - ramp);
+    if (t < 2 * ramp + cruise) {
+        const double left = 2 * ramp + cruise - t;
+        return distance - 0.5 * accel * left * left;
+    }
+    return distance;
+}
+
+static int build_profile(const sweep_point *p, int steps, double step_times[]) {
+    // Averaging the trapezoid velocity over a window of accel / jerk limits the jerk to that value:
+    // the ramps become S-curves and the move takes one window longer
+    const double window = p->jerk > 0 ? p->accel / p->jerk : 0;
+    double speed = fmin(p->speed, sqrt(steps * p->accel));
+    const double duration = 2 * speed / p->accel + (steps - speed * speed / p->accel) / speed + window;
+    double position = 0;
+    int step = 0;
+    for (double t = 0; t < duration && step < steps; t += PROFILE_DT) {
+        double velocity;
+        if (window > 0) {
+            velocity = (trapezoid_position(t + PROFILE_DT, steps, p->speed, p->accel) -
+                        trapezoid_position(t + PROFILE_DT - window, steps, p->speed, p->accel)) / window;
+        } else {
+            velocity = (trapezoid_position(t + PROFILE_DT, steps, p->speed, p->accel) -
+                        trapezoid_position(t, steps, p->speed, p->accel)) / PROFILE_DT;
+        }
+        const double next = position + velocity * PROFILE_DT;
+        // Step i is due when the position passes i, interpolated inside the interval
+        while (step < steps && next >= step + 1) {
+            step_times[step] = t + (step + 1 - position) / (next - position) * PROFILE_DT;
+            step++;
+        }
+        position = next;
+    }
+    // Rounding may leave the last step short of the end of the profile
+    for (; step < steps; step++)
+        step_times[step] = duration;
+    return steps;
+}
+
+static void *worker(void *arg) {
+    sweep *s = arg;
+    double *step_times = malloc((size_t)s->steps * sizeof(double));
+    for (int i = atomic_fetch_add(&s->next, 1); i < s->count; i = atomic_fetch_add(&s->next, 1)) {
+        sweep_point *p = &s->points[i];
+        build_profile(p, s->steps, step_times);
+        p->result = dynamics_run(&s->motor, p->mode, p->current, step_times, s->steps);
+    }
+    free(step_times);
+    return NULL;
+}
+
+static void mark_pareto(sweep_point points[], int count, int max_missed) {
+    for (int i = 0; i < count; i++) {
+        points[i].pareto = points[i].result.missed <= max_missed;
+        for (int j = 0; j < count && points[i].pareto; j++) {
+            if (points[j].result.missed <= max_missed && dominates(&points[j].result, &points[i].result))
+                points[i].pareto = false;
+        }
+    }
+}
+
+static bool dominates(const move_result *a, const move_result *b) {
+    if (a->time_s > b->time_s || a->missed > b->missed || a->energy_j > b->energy_j)
+        return false;
+    return a->time_s < b->time_s || a->missed < b->missed || a->energy_j < b->energy_j;
+}
+
+static int compare_time(const void *a, const void *b) {
+    const double x = ((const sweep_point *)a)->result.time_s;
+    const double y = ((const sweep_point *)b)->result.time_s;
+    return (x > y) - (x < y);
+}
+
+static int parse_list(const char *text, double list[]) {
+    int count = 0;
+    const char *p = text;
+    while (*p != '\0' && count < MAX_LIST) {
+        char *end;
+        list[count++] = strtod(p, &end);
+        if (end == p)
+            return 0;
+        p = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+            return 0;
+    }
+    return *p == '\0' ? count : 0;
+}
+
+static int parse_modes(const char *text, drive_mode list[]) {
+    char copy[128];
+    snprintf(copy, sizeof(copy), "%s", text);
+    int count = 0;
+    char *save;
+    for (char *name = strtok_r(copy, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        if (count == MAX_LIST || !drive_mode_parse(name, &list[count]))
+            return 0;
+        count++;
+    }
+    return count;
+}
+
+static void print_point(const sweep_point *p) {
+    printf("%6.0f %6.0f %6.0f  %s  %7.2f %7.3f %7d %9.3f%s\n", p->speed, p->accel, p->jerk, drive_mode_name(p->mode),
+           p->current, p->result.time_s, p->result.missed, p->result.energy_j, p->pareto ? "  *" : "");
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    fprintf(stderr, "  --steps N             length of the move in half-steps (default 4096)\n");
+    fprintf(stderr, "  --speeds LIST         top speeds in half-steps/s (default 400,600,800,1000,1200)\n");
+    fprintf(stderr, "  --accels LIST         accelerations in half-steps/s^2 (default 1000,2000,4000,8000)\n");
+    fprintf(stderr, "  --jerks LIST          jerk limits in half-steps/s^3, 0 = none (default 0,20000,50000)\n");
+    fprintf(stderr, "  --modes LIST          drive modes wave, full, half (default all three)\n");
+    fprintf(stderr, "  --currents LIST       coil PWM duty, 0..1 (default 0.5,0.75,1)\n");
+    fprintf(stderr, "  --torque N            peak acceleration of one coil in half-steps/s^2 (default 60000)\n");
+    fprintf(stderr, "  --corner N            speed where the coil current has dropped by 3 dB (default 400)\n");
+    fprintf(stderr, "  --friction N          gear train friction in half-steps/s^2 (default 12000)\n");
+    fprintf(stderr, "  --damping N           viscous damping in 1/s (default 10)\n");
+    fprintf(stderr, "  --max-missed N        most lost steps a point on the Pareto front may have (default 0)\n");
+    fprintf(stderr, "  --threads N           worker threads (default: one per CPU)\n");
+    fprintf(stderr, "  --all                 print every point, not just the Pareto front\n");
+}
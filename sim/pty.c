@@ -0,0 +1,42 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "sim.h"
+
+int sim_pty_open(const char *link_path) {
+    const int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        fprintf(stderr, "sim: cannot create a pseudo-terminal: %s\n", strerror(errno));
+        return -1;
+    }
+    const char *slave_path = ptsname(master);
+    // Hold the slave side open: without it the master reads EIO between host connections
+    const int slave = open(slave_path, O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        fprintf(stderr, "sim: cannot open %s: %s\n", slave_path, strerror(errno));
+        return -1;
+    }
+    // Raw like a CDC ACM port: no echo, no line editing, no newline translation
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B115200);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    if (link_path != NULL) {
+        unlink(link_path);
+        if (symlink(slave_path, link_path) != 0) {
+            fprintf(stderr, "sim: cannot link %s: %s\n", link_path, strerror(errno));
+            return -1;
+        }
+        fprintf(stderr, "sim: serial port %s -> %s\n", link_path, slave_path);
+    } else {
+        fprintf(stderr, "sim: serial port %s\n", slave_path);
+    }
+    return master;
+}
@@ -0,0 +1,76 @@
+// Step time benchmark: the acceleration from standstill read from the compile-time ramp table against
+// the per-step sqrtf() the firmware computed before the table. Both paths use the firmware's
+// expressions. The host has a hardware square root; the RP2040 has no FPU and pays for a soft-float
+// sqrtf() and division on every step, so the gap on the unit is wider than the one shown here.
+#define _POSIX_C_SOURCE 199309L
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ramp_table.h"
+
+#define DEFAULT_ROUNDS 20000 // Full ramps timed per path
+
+static uint64_t sqrtf_step_us(float v0, float a, int step); // Accelerating branch of profile_step_us()
+static double seconds_now(void); // Monotonic clock
+
+// Volatile so the compiler cannot fold the rate and acceleration into constants or hoist the work out
+static volatile float entry_rate = 0;
+static volatile float accel = MAX_ACCEL;
+
+int main(int argc, char **argv) {
+    const int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+    const ramp_table *ramp = ramp_table_find(MAX_ACCEL);
+    if (rounds <= 0 || ramp == NULL) {
+        fprintf(stderr, "usage: %s [ROUNDS]\n", argv[0]);
+        return 1;
+    }
+
+    // The table must hold the times the formula gives, to the microsecond it truncates to
+    uint64_t max_diff = 0;
+    for (int k = 0; k < ramp->length; k++) {
+        const uint64_t computed = sqrtf_step_us(entry_rate, accel, k);
+        const uint64_t diff = computed > ramp->times_us[k] ? computed - ramp->times_us[k] : ramp->times_us[k] - computed;
+        max_diff = diff > max_diff ? diff : max_diff;
+    }
+
+    // Sums keep every result live
+    uint64_t sum_sqrtf = 0;
+    uint64_t sum_table = 0;
+    double start = seconds_now();
+    for (int r = 0; r < rounds; r++) {
+        const float v0 = entry_rate;
+        const float a = accel;
+        for (int k = 0; k < ramp->length; k++)
+            sum_sqrtf += sqrtf_step_us(v0, a, k);
+    }
+    const double sqrtf_s = seconds_now() - start;
+    start = seconds_now();
+    for (int r = 0; r < rounds; r++) {
+        const ramp_table *volatile table = ramp;
+        for (int k = 0; k < table->length; k++)
+            sum_table += table->times_us[k];
+    }
+    const double table_s = seconds_now() - start;
+
+    const double steps = (double)rounds * ramp->length;
+    printf("Ramp %.0f steps/s^2 to %.0f steps/s: %d steps, max difference %llu us\n", MAX_ACCEL, MAX_STEP_RATE,
+           ramp->length, (unsigned long long)max_diff);
+    printf("sqrtf: %.2f ns/step\n", sqrtf_s * 1e9 / steps);
+    printf("table: %.2f ns/step\n", table_s * 1e9 / steps);
+    printf("speed-up %.1fx (checksums %llu %llu)\n", sqrtf_s / table_s, (unsigned long long)sum_sqrtf,
+           (unsigned long long)sum_table);
+    return 0;
+}
+
+static uint64_t sqrtf_step_us(const float v0, const float a, const int step) {
+    const float s = (float)step;
+    return (uint64_t)((sqrtf(v0 * v0 + 2.0f * a * s) - v0) / a * 1000000.0f);
+}
+
+static double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "sim.h"
+
+// One decoded capture record
+typedef struct {
+    uint8_t tag; // CAPTURE_INPUT, CAPTURE_EDGE_LOW or CAPTURE_EDGE_HIGH
+    uint32_t a; // Input: ms since the previous byte; edge: zigzag-encoded signed steps since the previous edge
+    uint32_t b; // Input: the byte; edge: us since the last step
+} replay_record;
+
+static replay_record *inputs; // Command bytes in order
+static int input_count;
+static int input_next;
+static uint64_t input_last_us; // When the previous replayed byte was read
+static replay_record *edges; // Opto edges in order
+static int edge_count;
+static int edge_next;
+static int32_t edge_step; // Step count the next edge belongs to
+static int32_t steps; // Net coil phase changes since the replay started, reverse ones counting down
+static uint64_t step_us; // Time of the last step
+static uint64_t edge_due_us = UINT64_MAX; // When the next edge is reported, UINT64_MAX until its step is reached
+static bool active;
+static bool level = true; // Level of the last replayed edge
+
+static bool get_varint(const uint8_t *log, size_t length, size_t *pos, uint32_t *value); // Decode one LEB128 varint
+static int32_t unzigzag(uint32_t value); // Undo the zigzag encoding of a signed number
+static void schedule_edge(void); // Set edge_due_us if the next edge belongs to the current step
+
+bool sim_replay_open(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+    // The file is a saved console log: only the "C <hex>" lines of "capture dump" matter
+    uint8_t *log = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "C ", 2) != 0)
+            continue;
+        for (const char *p = line + 2; p[0] != '\0' && p[1] != '\0' && p[0] != '\r' && p[0] != '\n'; p += 2) {
+            unsigned byte;
+            if (sscanf(p, "%2x", &byte) != 1)
+                break;
+            // Double the buffer when it is full so a long log is not copied once per byte
+            if (length == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 1024;
+                uint8_t *grown = realloc(log, capacity);
+                if (grown == NULL) {
+                    free(log);
+                    fclose(f);
+                    return false;
+                }
+                log = grown;
+            }
+            log[length++] = (uint8_t)byte;
+        }
+    }
+    fclose(f);
+
+    inputs = calloc(length + 1, sizeof(replay_record));
+    edges = calloc(length + 1, sizeof(replay_record));
+    if (inputs == NULL || edges == NULL) {
+        free(inputs);
+        free(edges);
+        free(log);
+        return false;
+    }
+    size_t pos = 0;
+    while (pos < length) {
+        replay_record r = {log[pos++], 0, 0};
+        bool ok = get_varint(log, length, &pos, &r.a);
+        if (r.tag == CAPTURE_INPUT && pos < length)
+            r.b = log[pos++];
+        else if (r.tag == CAPTURE_EDGE_LOW || r.tag == CAPTURE_EDGE_HIGH)
+            ok = ok && get_varint(log, length, &pos, &r.b);
+        else
+            ok = false;
+        if (!ok) {
+            fprintf(stderr, "sim: capture log damaged at byte %zu\n", pos);
+            break;
+        }
+        if (r.tag == CAPTURE_INPUT)
+            inputs[input_count++] = r;
+        else
+            edges[edge_count++] = r;
+    }
+    free(log);
+    fprintf(stderr, "sim: replaying %d command bytes and %d opto edges\n", input_count, edge_count);
+    active = true;
+    edge_step = edge_count > 0 ? unzigzag(edges[0].a) : 0;
+    schedule_edge();
+    return true;
+}
+
+bool sim_replay_active(void) {
+    return active;
+}
+
+int sim_replay_input(uint64_t now_us, uint64_t *due_us) {
+    if (input_next == input_count)
+        return SIM_REPLAY_END;
+    *due_us = input_last_us + (uint64_t)inputs[input_next].a * 1000u;
+    if (now_us < *due_us)
+        return SIM_REPLAY_WAIT;
+    input_last_us = now_us;
+    return (int)inputs[input_next++].b;
+}
+
+void sim_replay_step(uint64_t now_us, int dir) {
+    steps += dir;
+    step_us = now_us;
+    schedule_edge();
+}
+
+uint64_t sim_replay_edge_due(void) {
+    return edge_due_us;
+}
+
+bool sim_replay_take_edge(void) {
+    level = edges[edge_next].tag == CAPTURE_EDGE_HIGH;
+    edge_next++;
+    edge_due_us = UINT64_MAX;
+    if (edge_next < edge_count) {
+        edge_step += unzigzag(edges[edge_next].a);
+        // A second edge after the same step keeps its recorded time
+        schedule_edge();
+    }
+    return level;
+}
+
+bool sim_replay_level(void) {
+    return level;
+}
+
+static void schedule_edge(void) {
+    if (edge_next < edge_count && edge_due_us == UINT64_MAX && steps == edge_step)
+        edge_due_us = step_us + edges[edge_next].b;
+}
+
+static int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1u);
+}
+
+static bool get_varint(const uint8_t *log, size_t length, size_t *pos, uint32_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 35 && *pos < length; shift += 7) {
+        const uint8_t byte = log[(*pos)++];
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
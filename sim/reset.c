@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/watchdog.h"
+#include "model.h"
+#include "sim.h"
+
+#define RESET_EXIT_CODE 99 // Exit status of a firmware process that asks to be started again
+
+// What a watchdog reset leaves alone, in memory shared with the supervising process
+typedef struct {
+    uint64_t now_us; // Simulated time of the reset
+    model_state model; // Motor, gearbox and output shaft
+    uint32_t scratch[8]; // Watchdog scratch registers
+    uint8_t flash[PICO_FLASH_SIZE_BYTES];
+    uint8_t uninitialized[]; // Variables declared __uninitialized_ram()
+} reset_state;
+
+// Placed by __uninitialized_ram(); the linker marks where the section starts and ends
+extern uint8_t __start_sim_uninitialized_ram[] __attribute__((weak));
+extern uint8_t __stop_sim_uninitialized_ram[] __attribute__((weak));
+
+static reset_state *saved; // NULL when resets are off
+
+int sim_reset_run(int (*firmware)(void)) {
+    // The firmware keeps its state in statics: a process forked from here starts it from its power-up state
+    const size_t uninitialized = (size_t)(__stop_sim_uninitialized_ram - __start_sim_uninitialized_ram);
+    void *shared = mmap(NULL, sizeof(reset_state) + uninitialized, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return firmware();
+    saved = shared;
+    bool reset = false;
+    while (true) {
+        fflush(stdout);
+        const pid_t pid = fork();
+        if (pid == 0) {
+            // The firmware goes down with the unit, e.g. when a fleet is stopped
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (reset) {
+                sim_clock_resume(saved->now_us);
+                model_restore(&saved->model);
+                memcpy((void *)watchdog_hw->scratch, saved->scratch, sizeof(saved->scratch));
+                memcpy(sim_flash, saved->flash, sizeof(sim_flash));
+                memcpy(__start_sim_uninitialized_ram, saved->uninitialized, uninitialized);
+                sim_watchdog_rebooted();
+            }
+            exit(firmware());
+        }
+        if (pid < 0) {
+            perror("sim: fork");
+            return 1;
+        }
+        int status;
+        while (waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR)
+                return 1;
+        }
+        if (!WIFEXITED(status))
+            return 1;
+        if (WEXITSTATUS(status) != RESET_EXIT_CODE)
+            return WEXITSTATUS(status);
+        reset = true;
+    }
+}
+
+bool sim_reset_enabled(void) {
+    return saved != NULL;
+}
+
+void sim_reset(void) {
+    saved->now_us = time_us_64();
+    model_save(&saved->model);
+    memcpy(saved->scratch, (const void *)watchdog_hw->scratch, sizeof(saved->scratch));
+    memcpy(saved->flash, sim_flash, sizeof(sim_flash));
+    memcpy(saved->uninitialized, __start_sim_uninitialized_ram,
+           (size_t)(__stop_sim_uninitialized_ram - __start_sim_uninitialized_ram));
+    fflush(stdout);
+    _exit(RESET_EXIT_CODE);
+}
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pico/stdlib.h"
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/watchdog.h"
+#include "stepper.h"
+#include "model.h"
+#include "sim.h"
+
+#define ADC_SAMPLE_US 50 // Free-running ADC period at the firmware's clock divider (20 kS/s)
+#define LEVEL_HISTORY 32 // Opto level changes kept for ADC samples that are filled in late
+
+uint8_t sim_flash[PICO_FLASH_SIZE_BYTES];
+static int flash_fd = -1; // Backing file of the flash image, -1 for none
+
+static adc_hw_t adc_regs;
+adc_hw_t *adc_hw = &adc_regs;
+static bool adc_running;
+static dma_channel_hw_t dma_regs;
+static volatile uint16_t *dma_ring; // Ring buffer the ADC channel writes into
+static uint dma_ring_samples; // Ring size in samples
+static uint dma_head; // Next sample slot in the ring
+static uint64_t dma_filled_us; // Time up to which the ring holds samples
+static uint64_t level_times[LEVEL_HISTORY]; // When the opto level changed, oldest overwritten first
+static uint16_t level_values[LEVEL_HISTORY]; // ADC reading from that time on
+static uint level_newest; // Index of the latest change
+
+static watchdog_hw_t watchdog_regs;
+watchdog_hw_t *watchdog_hw = &watchdog_regs;
+static uint32_t watchdog_timeout_us; // 0 while the watchdog is off
+static uint64_t watchdog_fed_us;
+static bool watchdog_reboot; // The firmware was started again by a watchdog reset
+
+static uint32_t gpio_out; // Levels driven by the firmware
+static uint32_t gpio_analog; // Pins handed to the ADC; their digital input reads 0
+static uint32_t last_pattern; // Last coil pattern other than all off
+static bool trace_outputs; // Log writes to the auxiliary outputs
+
+static void check_watchdog(uint64_t now_us); // Report a missed watchdog deadline
+static uint32_t coil_pattern(void); // IN1..IN4 levels as bits 0..3
+static void flash_persist(uint32_t offset, size_t count); // Write a changed flash range to the backing file
+static void record_level(uint64_t now_us); // Remember the current opto level for ADC samples filled in later
+static uint16_t level_at(uint64_t time_us); // Opto level an ADC sample taken at time_us saw
+
+void sim_sdk_init(void) {
+    memset(sim_flash, 0xff, sizeof(sim_flash));
+}
+
+void sim_trace_outputs(bool on) {
+    trace_outputs = on;
+}
+
+void gpio_init(uint gpio) {
+    gpio_out &= ~(1u << gpio);
+    if (gpio_analog >> gpio & 1u) {
+        gpio_analog &= ~(1u << gpio);
+        sim_pio_inputs_changed(time_us_64());
+    }
+}
+
+void gpio_init_mask(uint32_t mask) {
+    gpio_out &= ~mask;
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+    (void)gpio;
+    (void)out;
+}
+
+void gpio_set_dir_out_masked(uint32_t mask) {
+    (void)mask;
+}
+
+void gpio_pull_up(uint gpio) {
+    (void)gpio;
+}
+
+void gpio_put(uint gpio, bool value) {
+    gpio_put_masked(1u << gpio, (uint32_t)value << gpio);
+}
+
+void gpio_put_masked(uint32_t mask, uint32_t value) {
+    gpio_out = (gpio_out & ~mask) | (value & mask);
+    for (int i = 0; trace_outputs && i < SIM_AUX_COUNT; i++) {
+        if (mask & 1u << (SIM_AUX0_PIN + i))
+            fprintf(stderr, "sim: out %d %d at output %.2f\n", i, (int)(gpio_out >> (SIM_AUX0_PIN + i) & 1u), model_output());
+    }
+    const uint32_t coils = 1u << IN1 | 1u << IN2 | 1u << IN3 | 1u << IN4;
+    if (!(mask & coils))
+        return;
+    const uint32_t pattern = coil_pattern();
+    // A replayed capture counts steps as the firmware does: every change to a new phase, forward when it is
+    // up the half-step sequence (full steps are two entries apart) and the first one after power-up
+    if (pattern != 0 && pattern != last_pattern) {
+        const int delta = (model_pattern_phase(pattern) - model_pattern_phase(last_pattern)) & 7;
+        if (sim_replay_active())
+            sim_replay_step(time_us_64(), last_pattern == 0 || delta < 4 ? 1 : -1);
+        last_pattern = pattern;
+    }
+    if (model_coils(pattern, time_us_64())) {
+        record_level(time_us_64());
+        sim_pio_inputs_changed(time_us_64());
+    }
+}
+
+void gpio_clr_mask(uint32_t mask) {
+    gpio_put_masked(mask, 0);
+}
+
+bool gpio_get(uint gpio) {
+    return sim_gpio_input(gpio) || (gpio_out >> gpio & 1u);
+}
+
+bool sim_gpio_input(unsigned pin) {
+    static const int gray[4] = {0, 1, 3, 2};
+    // The input buffer of an analog pin is off
+    if (gpio_analog >> pin & 1u)
+        return false;
+    if (pin == SIM_SENSOR_PIN)
+        return sim_replay_active() ? sim_replay_level() : model_sensor();
+    if (pin == SIM_ENC_A_PIN || pin == SIM_ENC_A_PIN + 1)
+        return gray[model_encoder_count() & 3] >> (pin - SIM_ENC_A_PIN) & 1;
+    // Nothing connected to the STEP/DIR inputs; other pins read their own output
+    return false;
+}
+
+void adc_init(void) {
+    adc_running = false;
+}
+
+void adc_gpio_init(uint gpio) {
+    gpio_analog |= 1u << gpio;
+    sim_pio_inputs_changed(time_us_64());
+}
+
+void adc_select_input(uint input) {
+    (void)input;
+}
+
+void adc_fifo_setup(bool en, bool dreq_en, uint16_t dreq_thresh, bool err_in_fifo, bool byte_shift) {
+    (void)en;
+    (void)dreq_en;
+    (void)dreq_thresh;
+    (void)err_in_fifo;
+    (void)byte_shift;
+}
+
+void adc_set_clkdiv(float clkdiv) {
+    (void)clkdiv;
+}
+
+void adc_run(bool run) {
+    adc_running = run;
+    dma_filled_us = time_us_64();
+    record_level(dma_filled_us);
+}
+
+void adc_fifo_drain(void) {
+}
+
+int dma_claim_unused_channel(bool required) {
+    (void)required;
+    return 0;
+}
+
+void dma_channel_unclaim(uint channel) {
+    (void)channel;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel) {
+    (void)channel;
+    dma_channel_config c = {0};
+    return c;
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size) {
+    (void)c;
+    (void)size;
+}
+
+void channel_config_set_read_increment(dma_channel_config *c, bool incr) {
+    (void)c;
+    (void)incr;
+}
+
+void channel_config_set_write_increment(dma_channel_config *c, bool incr) {
+    (void)c;
+    (void)incr;
+}
+
+void channel_config_set_ring(dma_channel_config *c, bool write, uint size_bits) {
+    (void)write;
+    // Only the ring size matters to the simulation
+    c->ctrl = size_bits;
+}
+
+void channel_config_set_dreq(dma_channel_config *c, uint dreq) {
+    (void)c;
+    (void)dreq;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+                           const volatile void *read_addr, uint transfer_count, bool trigger) {
+    (void)channel;
+    (void)read_addr;
+    (void)transfer_count;
+    (void)trigger;
+    dma_ring = (volatile uint16_t *)write_addr;
+    dma_ring_samples = (1u << config->ctrl) / sizeof(uint16_t);
+    dma_head = 0;
+    dma_filled_us = time_us_64();
+    dma_regs.write_addr = (uint32_t)(uintptr_t)dma_ring;
+}
+
+dma_channel_hw_t *dma_channel_hw_addr(uint channel) {
+    (void)channel;
+    // Catch up on the conversions since the last look, each with the level at its own sample time
+    if (dma_ring != NULL && adc_running) {
+        const uint64_t now = time_us_64();
+        const uint64_t samples = (now - dma_filled_us) / ADC_SAMPLE_US;
+        // Older samples than a whole ring would be overwritten anyway
+        const uint64_t skip = samples > dma_ring_samples ? samples - dma_ring_samples : 0;
+        for (uint64_t i = skip; i < samples; i++) {
+            dma_ring[dma_head] = level_at(dma_filled_us + (i + 1) * ADC_SAMPLE_US);
+            dma_head = (dma_head + 1) % dma_ring_samples;
+        }
+        dma_filled_us += samples * ADC_SAMPLE_US;
+        dma_regs.write_addr = (uint32_t)(uintptr_t)(dma_ring + dma_head);
+    }
+    return &dma_regs;
+}
+
+void dma_channel_abort(uint channel) {
+    (void)channel;
+    dma_ring = NULL;
+}
+
+bool sim_flash_open(const char *path) {
+    flash_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (flash_fd < 0)
+        return false;
+    // A new or short file reads as erased flash
+    const ssize_t n = pread(flash_fd, sim_flash, sizeof(sim_flash), 0);
+    if (n < (ssize_t)sizeof(sim_flash)) {
+        memset(sim_flash + (n > 0 ? n : 0), 0xff, sizeof(sim_flash) - (size_t)(n > 0 ? n : 0));
+        flash_persist(0, sizeof(sim_flash));
+    }
+    return true;
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    memset(sim_flash + flash_offs, 0xff, count);
+    flash_persist(flash_offs, count);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count) {
+    // Programming can only clear bits
+    for (size_t i = 0; i < count; i++)
+        sim_flash[flash_offs + i] &= data[i];
+    flash_persist(flash_offs, count);
+}
+
+static void flash_persist(uint32_t offset, size_t count) {
+    if (flash_fd >= 0 && pwrite(flash_fd, sim_flash + offset, count, offset) != (ssize_t)count)
+        fprintf(stderr, "sim: flash write failed: %s\n", strerror(errno));
+}
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug) {
+    (void)pause_on_debug;
+    watchdog_timeout_us = delay_ms * 1000u;
+    watchdog_fed_us = time_us_64();
+}
+
+void watchdog_update(void) {
+    watchdog_fed_us = time_us_64();
+}
+
+bool watchdog_caused_reboot(void) {
+    return watchdog_reboot;
+}
+
+void sim_watchdog_rebooted(void) {
+    watchdog_reboot = true;
+}
+
+void sim_hardware_service(uint64_t now_us) {
+    sim_pio_service(now_us);
+    check_watchdog(now_us);
+}
+
+uint64_t sim_hardware_next_due(void) {
+    return sim_pio_next_due();
+}
+
+static void check_watchdog(uint64_t now_us) {
+    if (watchdog_timeout_us == 0 || now_us - watchdog_fed_us <= watchdog_timeout_us)
+        return;
+    // A replayed capture cannot be carried over into the restarted firmware
+    if (sim_reset_enabled() && !sim_replay_active()) {
+        fprintf(stderr, "sim: watchdog not fed for %llu ms, resetting\n",
+                (unsigned long long)((now_us - watchdog_fed_us) / 1000));
+        sim_reset();
+    }
+    fprintf(stderr, "sim: watchdog not fed for %llu ms, a real unit would reset here\n",
+            (unsigned long long)((now_us - watchdog_fed_us) / 1000));
+    watchdog_fed_us = now_us;
+}
+
+static void record_level(uint64_t now_us) {
+    level_newest = (level_newest + 1) % LEVEL_HISTORY;
+    level_times[level_newest] = now_us;
+    level_values[level_newest] = model_sensor_adc();
+}
+
+static uint16_t level_at(uint64_t time_us) {
+    uint i = level_newest;
+    for (int n = 1; n < LEVEL_HISTORY && level_times[i] > time_us; n++)
+        i = (i + LEVEL_HISTORY - 1) % LEVEL_HISTORY;
+    return level_values[i];
+}
+
+static uint32_t coil_pattern(void) {
+    return (gpio_out >> IN1 & 1u) | (gpio_out >> IN2 & 1u) << 1 | (gpio_out >> IN3 & 1u) << 2 | (gpio_out >> IN4 & 1u) << 3;
+}
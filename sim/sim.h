@@ -0,0 +1,56 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Board wiring the simulated hardware is attached to (matches main.c and stepper.h)
+#define SIM_SENSOR_PIN 28 // Opto fork output, also ADC input 2
+#define SIM_STEP_IN_PIN 16 // STEP input of the follower mode
+#define SIM_ENC_A_PIN 18 // Encoder A, B on the next pin
+#define SIM_AUX0_PIN 14 // Auxiliary outputs, AUX1 on the next pin
+#define SIM_AUX_COUNT 2
+
+// clock.c: simulated time, sleeping and the serial input
+void sim_clock_init(bool virtual_time); // Start at time 0; virtual time only moves when the firmware waits
+uint64_t sim_clock_input_end(void); // When the firmware asked for input after the last piped byte
+void sim_clock_resume(uint64_t now_us); // Virtual clock: continue from a time reached before a reset
+#define SIM_HANG_BYTE 0x1c // Ctrl-\ in the input hangs the firmware until the watchdog resets it
+
+// sdk.c: simulated SDK services
+void sim_sdk_init(void); // Erase the flash image
+bool sim_flash_open(const char *path); // Back the flash image with a file so macros survive restarts
+void sim_trace_outputs(bool on); // Log every write to the auxiliary outputs on stderr
+void sim_watchdog_rebooted(void); // watchdog_caused_reboot() answers true from now on
+bool sim_gpio_input(unsigned pin); // Level the hardware drives onto an input pin
+void sim_hardware_service(uint64_t now_us); // Deliver hardware events due by now_us, check the watchdog
+uint64_t sim_hardware_next_due(void); // Time of the next hardware event, UINT64_MAX if none
+
+// pio.c: models of the firmware's PIO programs and the interrupts they raise
+void sim_pio_inputs_changed(uint64_t now_us); // Sample the modelled inputs after the mechanics moved
+void sim_pio_service(uint64_t now_us); // Report filtered edges that have become due and run their handlers
+uint64_t sim_pio_next_due(void); // Time of the next pending report, UINT64_MAX if none
+bool sim_step_input_open(const char *spec); // STEP/DIR pulse bursts "N,-N,..." sent once the follower starts
+bool sim_step_input_pending(void); // The follower has started and the pulses have not all been sent and followed
+
+// replay.c: command bytes and opto edges from a "capture dump" instead of the host and the opto model
+#define SIM_REPLAY_WAIT (-1) // The next byte is not due yet
+#define SIM_REPLAY_END (-2) // All bytes have been replayed
+bool sim_replay_open(const char *path); // Load a saved console log holding a capture dump
+bool sim_replay_active(void); // A log is being replayed
+int sim_replay_input(uint64_t now_us, uint64_t *due_us); // Next byte if due, else SIM_REPLAY_WAIT with its due time or SIM_REPLAY_END
+void sim_replay_step(uint64_t now_us, int dir); // The coils moved to a new phase in the given direction
+uint64_t sim_replay_edge_due(void); // Report time of the next edge, UINT64_MAX until its step has been taken
+bool sim_replay_take_edge(void); // Consume the due edge, returns its level
+bool sim_replay_level(void); // Opto level after the last replayed edge
+
+// reset.c: watchdog resets; the firmware restarts from its power-up state while the mechanics, the clock,
+// the flash, the watchdog scratch registers and the reset-proof RAM carry over
+int sim_reset_run(int (*firmware)(void)); // Run the firmware in a child process, again after every reset
+bool sim_reset_enabled(void); // Missed watchdog deadlines reset the firmware
+void sim_reset(void); // Reset the firmware now (does not return)
+
+// pty.c: pseudo-terminal standing in for the USB serial port
+int sim_pty_open(const char *link_path); // Create the PTY, print its path, optionally symlink it; master fd or -1
+
+#endif
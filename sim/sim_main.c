@@ -0,0 +1,225 @@
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "model.h"
+#include "sim.h"
+
+#define MAX_UNITS 256 // Largest --units
+#define DEFAULT_FLEET_LINK "/tmp/ttySIM" // Link prefix of a fleet without --link
+
+int firmware_main(void); // main() of main.c, renamed by the build
+
+// How one simulated unit is brought up
+typedef struct {
+    model_params params;
+    bool virtual_clock;
+    bool use_pty;
+    const char *link_path;
+    const char *flash_path;
+    const char *replay_path;
+    const char *step_input;
+    bool trace_outputs;
+} unit_config;
+
+static pid_t fleet[MAX_UNITS]; // Unit processes of --units
+static int fleet_size;
+static volatile sig_atomic_t fleet_stopping; // Set once the units have been told to stop
+
+static int run_unit(const unit_config *config); // Bring up the board model and run the firmware
+static int run_fleet(const unit_config *config, int units); // One process and PTY per unit, until all exit
+static void stop_fleet(int sig); // Pass a termination signal on to the units
+static void usage(const char *name); // Print the options
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"pty", no_argument, NULL, 'p'},
+        {"clock", required_argument, NULL, 'k'},
+        {"link", required_argument, NULL, 'l'},
+        {"flash", required_argument, NULL, 'f'},
+        {"replay", required_argument, NULL, 'y'},
+        {"units", required_argument, NULL, 'u'},
+        {"trace-outputs", no_argument, NULL, 'o'},
+        {"step-in", required_argument, NULL, 'i'},
+        {"steps-per-rev", required_argument, NULL, 'r'},
+        {"backlash", required_argument, NULL, 'b'},
+        {"slot-start", required_argument, NULL, 's'},
+        {"slot-width", required_argument, NULL, 'w'},
+        {"edge-width", required_argument, NULL, 'e'},
+        {"start", required_argument, NULL, 'x'},
+        {"encoder", required_argument, NULL, 'c'},
+        {"edge-jitter", required_argument, NULL, 'j'},
+        {"miss-rate", required_argument, NULL, 'm'},
+        {"pullout", required_argument, NULL, 'P'},
+        {"seed", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    unit_config config = {.use_pty = false, .link_path = NULL, .flash_path = NULL, .replay_path = NULL, .step_input = NULL,
+                          .trace_outputs = false};
+    model_params *params = &config.params;
+    model_defaults(params);
+    const char *clock_mode = NULL;
+    int units = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'p': config.use_pty = true; break;
+            case 'l': config.use_pty = true; config.link_path = optarg; break;
+            case 'k': clock_mode = optarg; break;
+            case 'f': config.flash_path = optarg; break;
+            case 'y': config.replay_path = optarg; break;
+            case 'u': units = atoi(optarg); break;
+            case 'o': config.trace_outputs = true; break;
+            case 'i': config.step_input = optarg; break;
+            case 'r': params->steps_per_rev = atof(optarg); break;
+            case 'b': params->backlash = atof(optarg); break;
+            case 's': params->slot_start = atof(optarg); break;
+            case 'w': params->slot_width = atof(optarg); break;
+            case 'e': params->edge_width = atof(optarg); break;
+            case 'x': params->start_position = atof(optarg); break;
+            case 'c': params->encoder_counts = atoi(optarg); break;
+            case 'j': params->edge_jitter = atof(optarg); break;
+            case 'm': params->miss_rate = atof(optarg); break;
+            case 'P': params->pullout_rate = atof(optarg); break;
+            case 'd': params->seed = strtoull(optarg, NULL, 10); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (params->steps_per_rev <= 0 || params->slot_width <= 0 || params->slot_width >= params->steps_per_rev) {
+        fprintf(stderr, "sim: the slot must be narrower than one revolution\n");
+        return 2;
+    }
+    // A fleet is only reachable through its PTYs, and one capture log cannot drive several units
+    if (units < 0 || units > MAX_UNITS || (units > 0 && config.replay_path != NULL)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (units > 0)
+        config.use_pty = true;
+
+    // Scripts run on the virtual clock; host software on the PTY gets real time unless asked otherwise
+    if (clock_mode == NULL)
+        clock_mode = config.use_pty ? "real" : "virtual";
+    if (strcmp(clock_mode, "real") != 0 && strcmp(clock_mode, "virtual") != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    config.virtual_clock = strcmp(clock_mode, "virtual") == 0;
+    return units > 0 ? run_fleet(&config, units) : run_unit(&config);
+}
+
+static int run_unit(const unit_config *config) {
+    sim_clock_init(config->virtual_clock);
+    sim_sdk_init();
+    sim_trace_outputs(config->trace_outputs);
+    model_init(&config->params);
+    if (config->flash_path != NULL && !sim_flash_open(config->flash_path)) {
+        fprintf(stderr, "sim: cannot open flash image %s\n", config->flash_path);
+        return 1;
+    }
+    if (config->step_input != NULL && !sim_step_input_open(config->step_input)) {
+        fprintf(stderr, "sim: bad STEP pulse list %s\n", config->step_input);
+        return 1;
+    }
+    if (config->replay_path != NULL && !sim_replay_open(config->replay_path)) {
+        fprintf(stderr, "sim: cannot open capture log %s\n", config->replay_path);
+        return 1;
+    }
+    // The PTY master becomes the firmware's stdin and stdout, like the USB serial port on the board
+    if (config->use_pty) {
+        const int master = sim_pty_open(config->link_path);
+        if (master < 0)
+            return 1;
+        dup2(master, STDIN_FILENO);
+        dup2(master, STDOUT_FILENO);
+        close(master);
+    }
+    return sim_reset_run(firmware_main);
+}
+
+static int run_fleet(const unit_config *config, int units) {
+    // The firmware keeps its state in statics, so every unit is a process of its own: a fork shares the
+    // code and copies only the pages a unit writes
+    const char *link_prefix = config->link_path != NULL ? config->link_path : DEFAULT_FLEET_LINK;
+    signal(SIGINT, stop_fleet);
+    signal(SIGTERM, stop_fleet);
+    for (int i = 0; i < units; i++) {
+        char link_path[256];
+        char flash_path[256];
+        snprintf(link_path, sizeof(link_path), "%s%d", link_prefix, i);
+        unit_config unit = *config;
+        unit.link_path = link_path;
+        // Each unit keeps its own macros and gets its own edge jitter and lost steps
+        if (config->flash_path != NULL) {
+            snprintf(flash_path, sizeof(flash_path), "%s.%d", config->flash_path, i);
+            unit.flash_path = flash_path;
+        }
+        unit.params.seed = config->params.seed + (uint64_t)i;
+        fflush(stdout);
+        const pid_t pid = fork();
+        if (pid == 0) {
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            _exit(run_unit(&unit));
+        }
+        if (pid < 0) {
+            perror("sim: fork");
+            stop_fleet(SIGTERM);
+            break;
+        }
+        fleet[fleet_size++] = pid;
+    }
+    // Serve until every unit is gone; one that stops does not take the others down
+    int failed = 0;
+    for (int running = fleet_size; running > 0; running--) {
+        int status;
+        const pid_t pid = wait(&status);
+        if (pid < 0)
+            break;
+        for (int i = 0; i < fleet_size; i++) {
+            if (fleet[i] == pid && !fleet_stopping && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+                fprintf(stderr, "sim: unit %d stopped (status 0x%x)\n", i, status);
+                failed++;
+            }
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+static void stop_fleet(int sig) {
+    fleet_stopping = 1;
+    for (int i = 0; i < fleet_size; i++)
+        kill(fleet[i], sig == SIGINT ? SIGTERM : sig);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    fprintf(stderr, "  --pty                serve the firmware console on a new pseudo-terminal\n");
+    fprintf(stderr, "  --link PATH          same, and symlink PATH to it (e.g. /tmp/ttySIM0)\n");
+    fprintf(stderr, "  --clock real|virtual wall clock time, or jump from event to event (default: real with\n");
+    fprintf(stderr, "                       --pty, virtual otherwise)\n");
+    fprintf(stderr, "  --flash FILE         keep the flash image (macros) in FILE\n");
+    fprintf(stderr, "  --replay FILE        take commands and opto edges from a saved \"capture dump\"\n");
+    fprintf(stderr, "  --units N            run N independent units, each on its own PTY linked at PATH0..\n");
+    fprintf(stderr, "                       (--link PATH, default %s) with macros in FILE.0.. and seeds\n", DEFAULT_FLEET_LINK);
+    fprintf(stderr, "                       counting up from --seed\n");
+    fprintf(stderr, "  --trace-outputs      log every write to the auxiliary outputs on stderr\n");
+    fprintf(stderr, "  --step-in N,-N,...   once \"follow\" starts, send these STEP pulse bursts at 500 Hz (negative:\n");
+    fprintf(stderr, "                       DIR low); piped input waits until they have been followed\n");
+    fprintf(stderr, "  --steps-per-rev N    half-steps per output revolution (default 4096.3)\n");
+    fprintf(stderr, "  --backlash N         gear play in half-steps (default 12)\n");
+    fprintf(stderr, "  --slot-start N       output position where the slot starts (default 100)\n");
+    fprintf(stderr, "  --slot-width N       half-steps the beam stays blocked (default 1900)\n");
+    fprintf(stderr, "  --edge-width N       half-steps over which the analog level ramps (default 10)\n");
+    fprintf(stderr, "  --start N            output position at power-up (default 0)\n");
+    fprintf(stderr, "  --encoder N          quadrature counts per output revolution (default none)\n");
+    fprintf(stderr, "  --edge-jitter N      standard deviation of each slot edge pass in half-steps (default 0)\n");
+    fprintf(stderr, "  --miss-rate P        probability that a step is lost (default 0)\n");
+    fprintf(stderr, "  --pullout R          step rate at which half of the steps are lost; the loss rises with\n");
+    fprintf(stderr, "                       the 8th power of the rate below it (default 0: none)\n");
+    fprintf(stderr, "  --seed N             seed of the jitter and the lost steps (default 1)\n");
+}
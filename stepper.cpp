@@ -0,0 +1,21 @@
+#include "stepper.h"
+#include "stepper.hpp"
+
+// The motor is driven in half steps; the C code only ever sees phase numbers
+using coil_driver = Stepper<pins<IN1, IN2, IN3, IN4>, half_step>;
+
+void stepper_init(void) {
+    coil_driver::init();
+}
+
+void stepper_energize(const int phase) {
+    coil_driver::energize(phase);
+}
+
+void stepper_release(void) {
+    coil_driver::release();
+}
+
+int stepper_phases(void) {
+    return coil_driver::phases;
+}
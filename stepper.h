@@ -0,0 +1,23 @@
+#ifndef STEPPER_H
+#define STEPPER_H
+
+// Stepper motor control pins
+#define IN1 2
+#define IN2 3
+#define IN3 6
+#define IN4 13
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void stepper_init(void); // Initialize the coil pins as outputs, all coils off
+void stepper_energize(int phase); // Drive the coil pattern of the given phase (wraps around)
+void stepper_release(void); // Switch all coils off
+int stepper_phases(void); // Phases in one cycle of the drive mode
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef STEPPER_HPP
+#define STEPPER_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include "pico/stdlib.h"
+
+// Coil patterns per drive mode. Bit i of a pattern energizes the i-th pin of the pin list.
+struct wave_drive {
+    static constexpr std::size_t coils = 4;
+    static constexpr std::array<uint8_t, 4> patterns = {0b0001, 0b0010, 0b0100, 0b1000}; // A, B, C, D
+};
+
+struct full_step {
+    static constexpr std::size_t coils = 4;
+    static constexpr std::array<uint8_t, 4> patterns = {0b0011, 0b0110, 0b1100, 0b1001}; // A+B, B+C, C+D, D+A
+};
+
+struct half_step {
+    static constexpr std::size_t coils = 4;
+    static constexpr std::array<uint8_t, 8> patterns = {
+        0b0001, // A
+        0b0011, // A + B
+        0b0010, // B
+        0b0110, // B + C
+        0b0100, // C
+        0b1100, // C + D
+        0b1000, // D
+        0b1001  // D + A
+    };
+};
+
+// GPIO numbers of the coil pins, first pin = coil A
+template <uint... Pins>
+struct pins {};
+
+template <typename Pins, typename DriveMode>
+class Stepper;
+
+// Coil driver with everything but the phase number resolved at compile time: one SIO write per step
+template <uint... Pins, typename DriveMode>
+class Stepper<pins<Pins...>, DriveMode> {
+public:
+    static constexpr int phases = (int)DriveMode::patterns.size();
+    static constexpr uint32_t mask = ((1u << Pins) | ...);
+
+    static_assert(sizeof...(Pins) == DriveMode::coils, "one pin per coil");
+    static_assert((phases & (phases - 1)) == 0, "phase count must be a power of two");
+    static_assert(((Pins < 30) && ...), "coil pins must be GPIO 0-29");
+
+    // Coil pins as outputs, all off
+    static void init() {
+        gpio_init_mask(mask);
+        gpio_clr_mask(mask);
+        gpio_set_dir_out_masked(mask);
+    }
+
+    // Drive one phase onto the coils; the phase wraps so any step count can be passed
+    static inline void energize(int phase) {
+        gpio_put_masked(mask, levels[phase & (phases - 1)]);
+    }
+
+    // All coils off
+    static inline void release() {
+        gpio_clr_mask(mask);
+    }
+
+private:
+    // Pattern bits spread onto the GPIO numbers of the pin list
+    static constexpr uint32_t levels_of(uint8_t pattern) {
+        uint32_t levels = 0;
+        std::size_t bit = 0;
+        ((levels |= (uint32_t)(pattern >> bit++ & 1u) << Pins), ...);
+        return levels;
+    }
+
+    template <std::size_t... Phase>
+    static constexpr std::array<uint32_t, sizeof...(Phase)> make_levels(std::index_sequence<Phase...>) {
+        return {levels_of(DriveMode::patterns[Phase])...};
+    }
+
+    static constexpr std::array<uint32_t, phases> levels = make_levels(std::make_index_sequence<phases>{});
+};
+
+#endif
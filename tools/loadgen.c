@@ -0,0 +1,402 @@
+// Command throughput load generator: drives a unit (or the simulator's PTY) with a command mix at
+// increasing rates and reports achieved commands/s, acknowledgement latency and failed responses.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROMPT "Enter cmd: " // The firmware is ready for the next command
+#define MAX_OUTSTANDING 64 // Largest --window
+#define MAX_STAGES 32 // Largest number of --rates
+#define RESPONSE_SIZE 4096 // Response text kept per command for classification
+#define SYNC_TIMEOUT_MS 3000 // Wait for the first prompt
+#define CALIB_TIMEOUT_MS 120000 // Wait for "calib" to finish
+#define DRAIN_QUIET_MS 200 // Silence that ends the replies of an earlier stage
+
+// Kinds of command in the mix
+typedef enum {
+    CMD_STATUS, // status poll
+    CMD_RUN, // run N slots
+    CMD_GOTO, // goto a random slot
+    CMD_TELEMETRY, // stats (the firmware's counters; there is no separate telemetry command)
+    CMD_KINDS
+} command_kind;
+
+// Command sent and not yet answered by a prompt
+typedef struct {
+    command_kind kind;
+    uint64_t sent_us;
+} outstanding_command;
+
+// Results of one rate stage
+typedef struct {
+    double target_rate; // Commands/s requested
+    int sent;
+    int acked;
+    int invalid; // Acknowledged with an error message
+    int dropped; // Never acknowledged
+    double elapsed_s; // From the first send to the last acknowledgement
+    double *latencies_ms; // One per acknowledged command
+} stage_result;
+
+static const char *kind_names[CMD_KINDS] = {"status", "run", "goto", "telemetry"};
+static const char *error_replies[] = {"Invalid input", "Calibrate first", "Input too long", "Empty input"};
+
+static int port = -1; // Serial port file descriptor
+static char response[RESPONSE_SIZE]; // Text received since the last prompt
+static size_t response_len;
+static outstanding_command queue[MAX_OUTSTANDING]; // Commands in the order they were sent
+static int queue_head;
+static int queue_count;
+
+static int open_port(const char *path); // Open the port raw, -1 on failure
+static uint64_t now_us(void); // Monotonic time
+static bool read_port(int timeout_ms, stage_result *stage); // Read and handle input, false on a port error
+static void prompt_received(stage_result *stage); // Match a prompt to the oldest outstanding command
+static void drain_port(int timeout_ms); // Discard input until the port has been quiet for a moment
+static bool wait_prompt(const char *command, int timeout_ms); // Send a command outside a stage and wait for its prompt
+static void format_command(command_kind kind, char *buf, size_t size, int run_slots); // Command text with its line ending
+static command_kind pick_command(const int weights[], int total); // Weighted random choice
+static bool parse_mix(const char *text, int weights[]); // "status:8,run:1,goto:1,telemetry:1"
+static int parse_rates(const char *text, double rates[]); // "1,2,5,10", number of rates or 0
+static void run_stage(stage_result *stage, double rate, double duration_s, int window, int timeout_ms,
+                      const int weights[], int run_slots); // Send at one rate, then collect the late acknowledgements
+static void print_stage(const stage_result *stage); // One line of the report
+static int compare_double(const void *a, const void *b); // qsort order
+static double percentile(const double sorted[], int count, double p); // Nearest-rank percentile
+static void usage(const char *name); // Print the options
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"mix", required_argument, NULL, 'm'},
+        {"rates", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"window", required_argument, NULL, 'w'},
+        {"timeout", required_argument, NULL, 't'},
+        {"run-slots", required_argument, NULL, 'n'},
+        {"calibrate", no_argument, NULL, 'c'},
+        {"seed", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int weights[CMD_KINDS] = {1, 0, 0, 0};
+    double rates[MAX_STAGES] = {1, 2, 5, 10, 20, 50, 100};
+    int stages = 7;
+    double duration_s = 10.0;
+    int window = 1;
+    int timeout_ms = 20000;
+    int run_slots = 1;
+    bool calibrate = false;
+    unsigned seed = 1;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (!parse_mix(optarg, weights)) {
+                    fprintf(stderr, "Invalid mix: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'r':
+                stages = parse_rates(optarg, rates);
+                if (stages == 0) {
+                    fprintf(stderr, "Invalid rates: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'd': duration_s = atof(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 't': timeout_ms = atoi(optarg); break;
+            case 'n': run_slots = atoi(optarg); break;
+            case 'c': calibrate = true; break;
+            case 's': seed = (unsigned)strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 || duration_s <= 0 || window < 1 || window > MAX_OUTSTANDING || timeout_ms <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    srand(seed);
+
+    port = open_port(argv[optind]);
+    if (port < 0)
+        return 1;
+    // A fresh prompt proves the unit answers and leaves nothing stale in the response buffer
+    if (!wait_prompt("status\r\n", SYNC_TIMEOUT_MS)) {
+        fprintf(stderr, "No prompt from %s\n", argv[optind]);
+        return 1;
+    }
+    if (calibrate && !wait_prompt("calib\r\n", CALIB_TIMEOUT_MS)) {
+        fprintf(stderr, "Calibration did not finish\n");
+        return 1;
+    }
+
+    printf("target/s  sent  acked   cmd/s  p50 ms  p90 ms  p99 ms  max ms  invalid  dropped\n");
+    double sustained = 0;
+    for (int i = 0; i < stages; i++) {
+        stage_result stage;
+        run_stage(&stage, rates[i], duration_s, window, timeout_ms, weights, run_slots);
+        print_stage(&stage);
+        // Sustained: every command answered correctly at (nearly) the requested rate
+        if (stage.dropped == 0 && stage.invalid == 0 && stage.acked / stage.elapsed_s >= 0.95 * rates[i])
+            sustained = rates[i];
+        free(stage.latencies_ms);
+    }
+    if (sustained > 0)
+        printf("Highest sustained rate: %.1f commands/s\n", sustained);
+    else
+        printf("No rate was sustained\n");
+    close(port);
+    return 0;
+}
+
+static int open_port(const char *path) {
+    const int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // The USB serial port ignores the baud rate, a real UART adapter needs it
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B115200);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static bool read_port(int timeout_ms, stage_result *stage) {
+    struct pollfd pfd = {port, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return true;
+    char buf[512];
+    const ssize_t n = read(port, buf, sizeof(buf));
+    if (n < 0)
+        return errno == EAGAIN || errno == EINTR;
+    if (n == 0)
+        return false;
+    for (ssize_t i = 0; i < n; i++) {
+        if (response_len < RESPONSE_SIZE - 1)
+            response[response_len++] = buf[i];
+        response[response_len] = '\0';
+        // The prompt ends every reply, so the text before it belongs to the oldest command
+        const size_t prompt_len = strlen(PROMPT);
+        if (response_len >= prompt_len && strcmp(response + response_len - prompt_len, PROMPT) == 0) {
+            response[response_len - prompt_len] = '\0';
+            prompt_received(stage);
+            response_len = 0;
+        }
+    }
+    return true;
+}
+
+static void prompt_received(stage_result *stage) {
+    if (queue_count == 0)
+        return;
+    const outstanding_command *cmd = &queue[queue_head];
+    queue_head = (queue_head + 1) % MAX_OUTSTANDING;
+    queue_count--;
+    if (stage == NULL)
+        return;
+    stage->latencies_ms[stage->acked++] = (double)(now_us() - cmd->sent_us) / 1000.0;
+    for (size_t i = 0; i < sizeof(error_replies) / sizeof(error_replies[0]); i++) {
+        if (strstr(response, error_replies[i]) != NULL) {
+            stage->invalid++;
+            break;
+        }
+    }
+}
+
+static void drain_port(int timeout_ms) {
+    const uint64_t deadline = now_us() + (uint64_t)timeout_ms * 1000u;
+    struct pollfd pfd = {port, POLLIN, 0};
+    char buf[512];
+    while (now_us() < deadline && poll(&pfd, 1, DRAIN_QUIET_MS) > 0) {
+        if (read(port, buf, sizeof(buf)) <= 0)
+            break;
+    }
+}
+
+static bool wait_prompt(const char *command, int timeout_ms) {
+    queue_head = 0;
+    queue_count = 1;
+    queue[0].sent_us = now_us();
+    response_len = 0;
+    if (write(port, command, strlen(command)) != (ssize_t)strlen(command))
+        return false;
+    const uint64_t deadline = now_us() + (uint64_t)timeout_ms * 1000u;
+    while (queue_count > 0 && now_us() < deadline) {
+        if (!read_port(100, NULL))
+            return false;
+    }
+    return queue_count == 0;
+}
+
+static void format_command(command_kind kind, char *buf, size_t size, int run_slots) {
+    switch (kind) {
+        case CMD_RUN: snprintf(buf, size, "run %d\r\n", run_slots); break;
+        case CMD_GOTO: snprintf(buf, size, "goto %d\r\n", rand() % 8); break;
+        case CMD_TELEMETRY: snprintf(buf, size, "stats\r\n"); break;
+        default: snprintf(buf, size, "status\r\n"); break;
+    }
+}
+
+static command_kind pick_command(const int weights[], int total) {
+    int r = rand() % total;
+    for (int i = 0; i < CMD_KINDS; i++) {
+        if (r < weights[i])
+            return (command_kind)i;
+        r -= weights[i];
+    }
+    return CMD_STATUS;
+}
+
+static bool parse_mix(const char *text, int weights[]) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", text);
+    for (int i = 0; i < CMD_KINDS; i++)
+        weights[i] = 0;
+    int total = 0;
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *colon = strchr(item, ':');
+        const int weight = colon != NULL ? atoi(colon + 1) : 1;
+        if (colon != NULL)
+            *colon = '\0';
+        int kind = -1;
+        for (int i = 0; i < CMD_KINDS; i++) {
+            if (strcmp(item, kind_names[i]) == 0)
+                kind = i;
+        }
+        if (kind < 0 || weight < 0)
+            return false;
+        weights[kind] = weight;
+        total += weight;
+    }
+    return total > 0;
+}
+
+static int parse_rates(const char *text, double rates[]) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", text);
+    int count = 0;
+    for (char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (count == MAX_STAGES || atof(item) <= 0)
+            return 0;
+        rates[count++] = atof(item);
+    }
+    return count;
+}
+
+static void run_stage(stage_result *stage, double rate, double duration_s, int window, int timeout_ms,
+                      const int weights[], int run_slots) {
+    memset(stage, 0, sizeof(*stage));
+    stage->target_rate = rate;
+    const int planned = (int)(rate * duration_s + 0.5) > 0 ? (int)(rate * duration_s + 0.5) : 1;
+    stage->latencies_ms = calloc((size_t)planned, sizeof(double));
+    int total_weight = 0;
+    for (int i = 0; i < CMD_KINDS; i++)
+        total_weight += weights[i];
+    // Replies to commands of an earlier stage that timed out must not be taken for this stage's
+    drain_port(timeout_ms);
+    queue_head = 0;
+    queue_count = 0;
+    response_len = 0;
+
+    const uint64_t interval_us = (uint64_t)(1000000.0 / rate);
+    const uint64_t start = now_us();
+    uint64_t next_send = start;
+    uint64_t last_activity = start;
+    bool port_ok = true;
+    // Open loop at the requested rate, but never more than the window unanswered
+    while (port_ok && (stage->sent < planned || queue_count > 0)) {
+        const uint64_t now = now_us();
+        if (stage->sent < planned && now >= next_send && queue_count < window) {
+            char command[32];
+            const command_kind kind = pick_command(weights, total_weight);
+            format_command(kind, command, sizeof(command), run_slots);
+            queue[(queue_head + queue_count) % MAX_OUTSTANDING].kind = kind;
+            queue[(queue_head + queue_count) % MAX_OUTSTANDING].sent_us = now;
+            queue_count++;
+            stage->sent++;
+            if (write(port, command, strlen(command)) != (ssize_t)strlen(command))
+                port_ok = false;
+            // A late send does not shift the schedule, so the rate is kept on average
+            next_send += interval_us;
+            last_activity = now;
+            continue;
+        }
+        // Nothing answered for the timeout: the outstanding commands are lost
+        if (queue_count > 0 && now - last_activity > (uint64_t)timeout_ms * 1000u) {
+            stage->dropped += queue_count;
+            queue_count = 0;
+            break;
+        }
+        int wait_ms = 10;
+        if (stage->sent < planned && queue_count < window)
+            wait_ms = next_send > now ? (int)((next_send - now + 999) / 1000) : 0;
+        const int acked = stage->acked;
+        port_ok = read_port(wait_ms, stage);
+        if (stage->acked != acked)
+            last_activity = now_us();
+    }
+    stage->dropped += planned - stage->sent;
+    // Sending takes the whole stage even when the last answer comes early
+    stage->elapsed_s = (double)(now_us() - start) / 1e6;
+    if (stage->elapsed_s < planned / rate)
+        stage->elapsed_s = planned / rate;
+}
+
+static void print_stage(const stage_result *stage) {
+    qsort(stage->latencies_ms, (size_t)stage->acked, sizeof(double), compare_double);
+    const int n = stage->acked;
+    printf("%8.1f %5d %6d %7.1f %7.1f %7.1f %7.1f %7.1f %8d %8d\n", stage->target_rate, stage->sent, n,
+           n / stage->elapsed_s, percentile(stage->latencies_ms, n, 50), percentile(stage->latencies_ms, n, 90),
+           percentile(stage->latencies_ms, n, 99), n > 0 ? stage->latencies_ms[n - 1] : 0.0, stage->invalid,
+           stage->dropped);
+    fflush(stdout);
+}
+
+static int compare_double(const void *a, const void *b) {
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double sorted[], int count, double p) {
+    if (count == 0)
+        return 0.0;
+    int rank = (int)(p / 100.0 * count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [options] PORT\n", name);
+    fprintf(stderr, "  --mix LIST       command weights, e.g. status:8,run:1,goto:1,telemetry:1 (default status)\n");
+    fprintf(stderr, "  --rates LIST     commands/s per stage (default 1,2,5,10,20,50,100)\n");
+    fprintf(stderr, "  --duration S     seconds per stage (default 10)\n");
+    fprintf(stderr, "  --window N       commands sent ahead of their prompt (default 1, max %d)\n", MAX_OUTSTANDING);
+    fprintf(stderr, "  --timeout MS     silence after which outstanding commands count as dropped (default 20000)\n");
+    fprintf(stderr, "  --run-slots N    slots per \"run\" command (default 1)\n");
+    fprintf(stderr, "  --calibrate      calibrate before the first stage (needed for run and goto)\n");
+    fprintf(stderr, "  --seed N         seed of the command mix (default 1)\n");
+}